@@ -0,0 +1,167 @@
+#ifndef EVENT_PARSE_H
+#define EVENT_PARSE_H
+
+/* userspace helpers for the /dev/fs_monitor record format
+ *
+ * every record is '\0' field '\0' field ... '\0' '\n', so fields are
+ * separated by single '\0's and the record ends with "\0\n"; poll reads
+ * also pad each record with '\0's up to ENTRY_SIZE
+ *
+ * write:  timestamp, path, middle (base64), file size, beginning (base64)
+ * unlink: timestamp, device, path, "<deleted>"
+ *
+ * with path_dict=1 the write path is replaced by '@major:minor:ino:gen',
+ * unlinks get it as an extra field, and the path itself comes once in
+ * path definition: timestamp, "<path_def>", '@major:minor:ino:gen', path
+ *
+ * with overload=1 the degraded period is wrapped in timestamp, "<overload_begin>"
+ * and timestamp, "<overload_end>", 'events=', 'dropped=' records, and events
+ * of that period come as timestamp, "<summary>", '@major:minor:ino:gen',
+ * path (if it could be resolved), 'writes=', 'bytes=', 'first=', 'last=',
+ * 'unlinked='
+ *
+ * identifiers always go right after the fields listed above, optional
+ * 'key=value' fields (ret_probes=1: ret, lat; attribution=1: tgid, pid,
+ * comm, cgid) follow them
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EV_MAX_FIELDS 16
+
+enum ev_type {
+    EV_UNKNOWN = 0,
+    EV_WRITE,
+    EV_UNLINK,
+    EV_PATH_DEF,
+    EV_SUMMARY,
+    EV_MARKER,
+};
+
+struct ev_record {
+    const char *field[EV_MAX_FIELDS];
+    size_t len[EV_MAX_FIELDS];
+    int nfields;
+    int type;
+    long long ts;
+    int path_idx; /* index of the path field or -1 */
+    int id_idx;   /* index of the '@major:minor:ino:gen' field or -1 */
+};
+
+/* find the end of the next record in [p, end): returns pointer to its '\n' or NULL */
+static inline const char *ev_next_record(const char *p, const char *end) {
+    return memchr(p, '\n', (size_t)(end - p));
+}
+
+/* split [start, nl) into fields, 'nl' points to the terminating '\n' */
+static inline int ev_parse(struct ev_record *rec, const char *start, const char *nl) {
+    const char *p = start, *f;
+
+    /* skip separator and poll padding before the first field */
+    while (p < nl && *p == '\0')
+        p++;
+    /* drop the '\0' right before '\n' */
+    if (nl > p && nl[-1] == '\0')
+        nl--;
+
+    rec->nfields = 0;
+    rec->type = EV_UNKNOWN;
+    rec->ts = 0;
+    rec->path_idx = -1;
+    rec->id_idx = -1;
+    if (p >= nl)
+        return -1;
+
+    while (rec->nfields < EV_MAX_FIELDS) {
+        f = memchr(p, '\0', (size_t)(nl - p));
+        rec->field[rec->nfields] = p;
+        rec->len[rec->nfields] = (f ? f : nl) - p;
+        rec->nfields++;
+        if (!f)
+            break;
+        p = f + 1;
+    }
+
+    rec->ts = strtoll(rec->field[0], NULL, 10);
+    if (rec->nfields >= 4 && rec->len[3] == 9 && !memcmp(rec->field[3], "<deleted>", 9)) {
+        rec->type = EV_UNLINK;
+        rec->path_idx = 2;
+        if (rec->nfields >= 5 && rec->len[4] > 0 && rec->field[4][0] == '@')
+            rec->id_idx = 4;
+    } else if (rec->nfields >= 4 && rec->len[1] == 10 && !memcmp(rec->field[1], "<path_def>", 10)) {
+        rec->type = EV_PATH_DEF;
+        rec->id_idx = 2;
+        rec->path_idx = 3;
+    } else if (rec->nfields >= 3 && rec->len[1] == 9 && !memcmp(rec->field[1], "<summary>", 9)) {
+        rec->type = EV_SUMMARY;
+        rec->id_idx = 2;
+        if (rec->nfields >= 4 && rec->len[3] > 0 && rec->field[3][0] == '/')
+            rec->path_idx = 3; /* sent by the module or resolved by fs_query */
+    } else if (rec->nfields >= 2 && rec->len[1] > 10 && !memcmp(rec->field[1], "<overload_", 10)) {
+        rec->type = EV_MARKER;
+    } else if (rec->nfields >= 5 && rec->len[1] > 0 && rec->field[1][0] == '/') {
+        rec->type = EV_WRITE;
+        rec->path_idx = 1;
+        if (rec->nfields >= 6 && rec->len[5] > 0 && rec->field[5][0] == '@')
+            rec->id_idx = 5; /* stored by fs_query after resolving the path */
+    } else if (rec->nfields >= 5 && rec->len[1] > 0 && rec->field[1][0] == '@') {
+        rec->type = EV_WRITE;
+        rec->id_idx = 1;
+    }
+
+    return 0;
+}
+
+/* FNV-1a, stable across runs so it can be persisted in indexes */
+static inline uint64_t ev_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* RFC 4648 base64 as sent by the module, returns decoded length or -1 */
+static inline int ev_base64_decode(const char *src, size_t len, unsigned char *dst) {
+    uint32_t ac = 0;
+    int bits = 0, out = 0, v;
+    size_t i;
+
+    for (i = 0; i < len && src[i] != '='; i++) {
+        char c = src[i];
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '+')
+            v = 62;
+        else if (c == '/')
+            v = 63;
+        else
+            return -1;
+        ac = (ac << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            dst[out++] = (unsigned char)(ac >> bits);
+        }
+    }
+    return out;
+}
+
+/* length of '@major:minor:ino' part of '@major:minor:ino:gen' */
+static inline size_t ev_inode_len(const char *id, size_t len) {
+    size_t i = len;
+    while (i > 0 && id[i - 1] != ':')
+        i--;
+    return i > 0 ? i - 1 : len;
+}
+
+#endif // EVENT_PARSE_H
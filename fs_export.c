@@ -0,0 +1,741 @@
+/* parallel decoder of the fs_monitor event stream
+ *
+ * fs_export [-f ndjson|columnar] [-j workers] [-b batch_kb] [-o output] [-i stats_sec] <input>
+ *
+ * one reader thread drains <input> (/dev/fs_monitor, a file or '-' for
+ * stdin) in large batches cut at record boundaries into a pool of recycled
+ * buffers, worker threads decode records and base64 samples in parallel,
+ * and the writer thread emits the results in input order; a full pool
+ * blocks the reader, which is reported as backpressure
+ *
+ * ndjson: one object per record, {"ts":..,"op":..,"path":..,"size":..,...},
+ *   samples come as hex strings, 'key=value' and '@id' fields become keys;
+ *   strings are passed as UTF-8 and only bytes that aren't part of valid
+ *   UTF-8 come as '\udcXX' (surrogateescape), so raw paths can be restored
+ *
+ * columnar: "FSMCOL2\0" header, then one block per batch, native endian:
+ *   u32 rows; i64 ts[rows]; i64 size[rows] (-1 if none); u8 op[rows];
+ *   u32 path_end[rows]; char paths[path_end[rows - 1]];
+ *   u32 id_end[rows]; char ids[id_end[rows - 1]]
+ *   empty if the record has no path or '@id', path_dict writes are joined
+ *   to paths through the ids of path_def rows
+ *
+ * build: cc -O2 -pthread -o fs_export fs_export.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "event_parse.h"
+
+#define DEFAULT_BATCH_KB 4096
+#define MAX_POLL_READ 1024 /* MONITOR_ENTRY_SIZE of the module: an event and its path definition */
+#define POLL_TIMEOUT_MS 100
+#define SAMPLE_MAX 64
+
+enum out_format {
+    FMT_NDJSON,
+    FMT_COLUMNAR,
+};
+
+enum col_op {
+    OP_UNKNOWN = 0,
+    OP_WRITE,
+    OP_UNLINK,
+    OP_PATH_DEF,
+    OP_SUMMARY,
+    OP_OVERLOAD_BEGIN,
+    OP_OVERLOAD_END,
+};
+
+static const char *op_names[] = {
+    [OP_UNKNOWN] = "unknown",
+    [OP_WRITE] = "write",
+    [OP_UNLINK] = "unlink",
+    [OP_PATH_DEF] = "path_def",
+    [OP_SUMMARY] = "summary",
+    [OP_OVERLOAD_BEGIN] = "overload_begin",
+    [OP_OVERLOAD_END] = "overload_end",
+};
+
+struct buf {
+    char *data;
+    size_t len, cap;
+};
+
+struct batch {
+    struct buf in, out;
+    uint64_t seq;
+    size_t records, skipped;
+    int done;
+};
+
+struct pipeline {
+    int fd, is_device, format;
+    FILE *out;
+    size_t batch_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t free_cond, work_cond, done_cond;
+
+    struct batch *batches;
+    int nbatches;
+    struct batch **free_list;  /* stack */
+    int nfree;
+    struct batch **work;       /* fifo */
+    int work_head, work_cnt;
+    struct batch **by_seq;     /* slot 'seq % nbatches' */
+    uint64_t produced, written;
+    int reader_done;
+
+    /* statistics */
+    uint64_t bytes_in, records, skipped;
+    uint64_t reader_wait_ns, writer_wait_ns;
+    int max_work;
+};
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t failed = 0; /* output is incomplete, exit with failure */
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int buf_reserve(struct buf *b, size_t n) {
+    char *data;
+    size_t cap;
+
+    if (b->len + n <= b->cap)
+        return 0;
+    cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n)
+        cap *= 2;
+    data = realloc(b->data, cap);
+    if (!data)
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static void buf_put(struct buf *b, const void *p, size_t n) {
+    if (buf_reserve(b, n)) {
+        failed = stop = 1;
+        return;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void buf_str(struct buf *b, const char *s) {
+    buf_put(b, s, strlen(s));
+}
+
+static void buf_num(struct buf *b, long long v) {
+    char tmp[32];
+    buf_put(b, tmp, (size_t)snprintf(tmp, sizeof(tmp), "%lld", v));
+}
+
+/* length of the well-formed UTF-8 sequence at 's', 0 if it isn't one (RFC 3629) */
+static size_t utf8_len(const unsigned char *s, size_t len) {
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n, i;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        n = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        n = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        n = 4;
+    else
+        return 0;
+    if (n > len)
+        return 0;
+
+    /* no overlong forms, surrogates or code points past U+10FFFF */
+    if (s[0] == 0xe0)
+        lo = 0xa0;
+    else if (s[0] == 0xed)
+        hi = 0x9f;
+    else if (s[0] == 0xf0)
+        lo = 0x90;
+    else if (s[0] == 0xf4)
+        hi = 0x8f;
+    if (s[1] < lo || s[1] > hi)
+        return 0;
+    for (i = 2; i < n; i++)
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+    return n;
+}
+
+/* JSON string, invalid UTF-8 bytes become lone surrogates U+DC80..U+DCFF */
+static void buf_json_str(struct buf *b, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char esc[6] = { '\\', 'u', '0', '0', 0, 0 };
+    size_t i, n;
+
+    buf_put(b, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            esc[4] = '\\';
+            buf_put(b, esc + 4, 1);
+            buf_put(b, &s[i], 1);
+        } else if (c < 0x20) {
+            esc[2] = esc[3] = '0';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            buf_put(b, esc, 6);
+        } else if (c < 0x80) {
+            buf_put(b, &s[i], 1);
+        } else if ((n = utf8_len((const unsigned char *)s + i, len - i)) != 0) {
+            buf_put(b, &s[i], n);
+            i += n - 1;
+        } else {
+            esc[2] = 'd';
+            esc[3] = 'c';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            buf_put(b, esc, 6);
+        }
+    }
+    buf_put(b, "\"", 1);
+}
+
+static int is_number(const char *s, size_t len) {
+    size_t i = (len > 0 && s[0] == '-') ? 1 : 0;
+    if (i == len)
+        return 0;
+    for (; i < len; i++)
+        if (s[i] < '0' || s[i] > '9')
+            return 0;
+    return 1;
+}
+
+/* samples are binary, so they are hex rather than JSON strings */
+static void json_sample(struct buf *b, const char *key, const char *s, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char raw[SAMPLE_MAX];
+    int i, n = len <= SAMPLE_MAX / 3 * 4 ? ev_base64_decode(s, len, raw) : -1;
+    char hex[2];
+
+    buf_str(b, ",\"");
+    buf_str(b, key);
+    buf_str(b, "\":");
+    if (n < 0) {
+        buf_str(b, "null");
+        return;
+    }
+    buf_put(b, "\"", 1);
+    for (i = 0; i < n; i++) {
+        hex[0] = digits[raw[i] >> 4];
+        hex[1] = digits[raw[i] & 0xf];
+        buf_put(b, hex, 2);
+    }
+    buf_put(b, "\"", 1);
+}
+
+/* which fields a record type starts with, the rest are '@id' and 'key=value' */
+static int record_layout(const struct ev_record *rec, int *op, int *size) {
+    *size = -1;
+
+    switch (rec->type) {
+    case EV_WRITE:
+        *op = OP_WRITE;
+        *size = 3;
+        return 5;
+    case EV_UNLINK:
+        *op = OP_UNLINK;
+        return 4;
+    case EV_PATH_DEF:
+        *op = OP_PATH_DEF;
+        return 4;
+    case EV_SUMMARY:
+        *op = OP_SUMMARY;
+        return rec->path_idx >= 0 ? 4 : 3;
+    case EV_MARKER:
+        *op = rec->len[1] > 14 && !memcmp(rec->field[1], "<overload_begin", 15) ? OP_OVERLOAD_BEGIN : OP_OVERLOAD_END;
+        return 2;
+    default:
+        *op = OP_UNKNOWN;
+        return rec->nfields;
+    }
+}
+
+static void ndjson_record(struct buf *b, const struct ev_record *rec) {
+    int op, size, base, i;
+    const char *eq;
+
+    base = record_layout(rec, &op, &size);
+
+    buf_str(b, "{\"ts\":");
+    buf_num(b, rec->ts);
+    buf_str(b, ",\"op\":\"");
+    buf_str(b, op_names[op]);
+    buf_str(b, "\"");
+    if (rec->path_idx >= 0) {
+        buf_str(b, ",\"path\":");
+        buf_json_str(b, rec->field[rec->path_idx], rec->len[rec->path_idx]);
+    }
+    if (rec->id_idx >= 0) {
+        buf_str(b, ",\"id\":");
+        buf_json_str(b, rec->field[rec->id_idx], rec->len[rec->id_idx]);
+    }
+    if (size >= 0) {
+        buf_str(b, ",\"size\":");
+        buf_num(b, strtoll(rec->field[size], NULL, 10));
+    }
+
+    switch (rec->type) {
+    case EV_WRITE:
+        json_sample(b, "middle", rec->field[2], rec->len[2]);
+        if (rec->field[4][0] == '<')
+            buf_str(b, ",\"begin\":null");
+        else
+            json_sample(b, "begin", rec->field[4], rec->len[4]);
+        break;
+    case EV_UNLINK:
+        buf_str(b, ",\"dev\":");
+        buf_json_str(b, rec->field[1], rec->len[1]);
+        break;
+    }
+
+    for (i = base; i < rec->nfields; i++) {
+        eq = memchr(rec->field[i], '=', rec->len[i]);
+        if (eq && i != rec->id_idx) {
+            size_t klen = (size_t)(eq - rec->field[i]), vlen = rec->len[i] - klen - 1;
+            buf_str(b, ",");
+            buf_json_str(b, rec->field[i], klen);
+            buf_str(b, ":");
+            if (is_number(eq + 1, vlen))
+                buf_put(b, eq + 1, vlen);
+            else
+                buf_json_str(b, eq + 1, vlen);
+        }
+    }
+    buf_str(b, "}\n");
+}
+
+/* per-worker column vectors, serialized once per batch */
+struct columns {
+    struct buf ts, size, op, path_end, paths, id_end, ids;
+    uint32_t rows;
+};
+
+/* variable length column: end offsets followed by the bytes */
+static void column_str(struct buf *ends, struct buf *data, const struct ev_record *rec, int idx) {
+    uint32_t end;
+
+    if (idx >= 0)
+        buf_put(data, rec->field[idx], rec->len[idx]);
+    end = (uint32_t)data->len;
+    buf_put(ends, &end, sizeof(end));
+}
+
+static void columns_record(struct columns *c, const struct ev_record *rec) {
+    int op, size;
+    int64_t v;
+    uint8_t op8;
+
+    record_layout(rec, &op, &size);
+
+    v = rec->ts;
+    buf_put(&c->ts, &v, sizeof(v));
+    v = size >= 0 ? strtoll(rec->field[size], NULL, 10) : -1;
+    buf_put(&c->size, &v, sizeof(v));
+    op8 = (uint8_t)op;
+    buf_put(&c->op, &op8, 1);
+    column_str(&c->path_end, &c->paths, rec, rec->path_idx);
+    column_str(&c->id_end, &c->ids, rec, rec->id_idx);
+    c->rows++;
+}
+
+static void columns_flush(struct columns *c, struct buf *out) {
+    buf_put(out, &c->rows, sizeof(c->rows));
+    buf_put(out, c->ts.data, c->ts.len);
+    buf_put(out, c->size.data, c->size.len);
+    buf_put(out, c->op.data, c->op.len);
+    buf_put(out, c->path_end.data, c->path_end.len);
+    buf_put(out, c->paths.data, c->paths.len);
+    buf_put(out, c->id_end.data, c->id_end.len);
+    buf_put(out, c->ids.data, c->ids.len);
+    c->ts.len = c->size.len = c->op.len = c->path_end.len = c->paths.len = c->id_end.len = c->ids.len = 0;
+    c->rows = 0;
+}
+
+static void decode_batch(struct pipeline *p, struct batch *b, struct columns *cols) {
+    const char *pos = b->in.data, *end = b->in.data + b->in.len, *nl;
+    struct ev_record rec;
+
+    b->out.len = 0;
+    b->records = b->skipped = 0;
+    while ((nl = ev_next_record(pos, end)) != NULL) {
+        if (!ev_parse(&rec, pos, nl)) {
+            if (rec.type == EV_UNKNOWN)
+                b->skipped++;
+            else if (p->format == FMT_NDJSON)
+                ndjson_record(&b->out, &rec);
+            else
+                columns_record(cols, &rec);
+            b->records++;
+        }
+        pos = nl + 1;
+    }
+    if (p->format == FMT_COLUMNAR && cols->rows)
+        columns_flush(cols, &b->out);
+}
+
+
+/* stages */
+
+static void *worker(void *arg) {
+    struct pipeline *p = arg;
+    struct columns cols;
+    struct batch *b;
+
+    memset(&cols, 0, sizeof(cols));
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->work_cnt && !p->reader_done)
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if (!p->work_cnt) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        b = p->work[p->work_head];
+        p->work_head = (p->work_head + 1) % p->nbatches;
+        p->work_cnt--;
+        pthread_mutex_unlock(&p->lock);
+
+        decode_batch(p, b, &cols);
+
+        pthread_mutex_lock(&p->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&p->done_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    free(cols.ts.data);
+    free(cols.size.data);
+    free(cols.op.data);
+    free(cols.path_end.data);
+    free(cols.paths.data);
+    free(cols.id_end.data);
+    free(cols.ids.data);
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    struct pipeline *p = arg;
+    struct batch *b;
+    uint64_t t;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        t = now_ns();
+        for (;;) {
+            b = p->by_seq[p->written % p->nbatches];
+            if (b && b->seq == p->written && b->done)
+                break;
+            if (p->reader_done && p->written == p->produced) {
+                pthread_mutex_unlock(&p->lock);
+                return NULL;
+            }
+            pthread_cond_wait(&p->done_cond, &p->lock);
+        }
+        p->writer_wait_ns += now_ns() - t;
+        pthread_mutex_unlock(&p->lock);
+
+        /* in input order, so path definitions always precede their events */
+        if (b->out.len && fwrite(b->out.data, 1, b->out.len, p->out) != b->out.len) {
+            perror("fwrite");
+            failed = stop = 1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->records += b->records;
+        p->skipped += b->skipped;
+        p->by_seq[p->written % p->nbatches] = NULL;
+        p->written++;
+        b->done = 0;
+        p->free_list[p->nfree++] = b;
+        pthread_cond_signal(&p->free_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static struct batch *get_free_batch(struct pipeline *p) {
+    struct batch *b;
+    uint64_t t = now_ns();
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->nfree)
+        pthread_cond_wait(&p->free_cond, &p->lock);
+    b = p->free_list[--p->nfree];
+    p->reader_wait_ns += now_ns() - t;
+    pthread_mutex_unlock(&p->lock);
+
+    b->in.len = 0;
+    return b;
+}
+
+static void dispatch(struct pipeline *p, struct batch *b) {
+    pthread_mutex_lock(&p->lock);
+    b->seq = p->produced++;
+    p->by_seq[b->seq % p->nbatches] = b;
+    p->work[(p->work_head + p->work_cnt) % p->nbatches] = b;
+    p->work_cnt++;
+    if (p->work_cnt > p->max_work)
+        p->max_work = p->work_cnt;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* returns bytes read, 0 on end of input or if a device has nothing for now */
+static ssize_t read_more(struct pipeline *p, struct batch *b) {
+    struct pollfd fds;
+    ssize_t len;
+
+    if (p->is_device) {
+        fds.fd = p->fd;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, POLL_TIMEOUT_MS) <= 0)
+            return 0;
+    }
+
+    len = read(p->fd, b->in.data + b->in.len, p->batch_size - b->in.len);
+    if (len < 0 && errno != EINTR) {
+        perror("read");
+        failed = stop = 1;
+    }
+    return len > 0 ? len : 0;
+}
+
+static void reader(struct pipeline *p) {
+    struct batch *b = get_free_batch(p), *next;
+    const char *last;
+    ssize_t len;
+    size_t tail;
+
+    while (!stop) {
+        len = read_more(p, b);
+        p->bytes_in += (uint64_t)len;
+        b->in.len += (size_t)len;
+
+        /* wait for more unless the batch is full or the input went quiet;
+         * the module returns a whole poll read even if it doesn't fit */
+        if (len > 0 && b->in.len + MAX_POLL_READ <= p->batch_size)
+            continue;
+        if (len == 0 && !p->is_device)
+            stop = 1;
+
+        last = b->in.len ? memrchr(b->in.data, '\n', b->in.len) : NULL;
+        if (!last) {
+            if (b->in.len == p->batch_size) /* garbage without record boundaries */
+                b->in.len = 0;
+            continue;
+        }
+
+        /* the incomplete record goes to the next batch */
+        next = get_free_batch(p);
+        tail = b->in.len - (size_t)(last + 1 - b->in.data);
+        memcpy(next->in.data, last + 1, tail);
+        next->in.len = tail;
+        b->in.len -= tail;
+        dispatch(p, b);
+        b = next;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->free_list[p->nfree++] = b;
+    p->reader_done = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_cond_broadcast(&p->done_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void print_stats(struct pipeline *p, uint64_t elapsed_ns) {
+    double sec = elapsed_ns ? elapsed_ns / 1e9 : 1e-9;
+
+    pthread_mutex_lock(&p->lock);
+    fprintf(stderr, "%.1fs: %llu bytes (%.1f MB/s), %llu records (%.0f/s), %llu skipped, "
+            "%llu batches, reader blocked %.3fs, writer waited %.3fs, max queue %d/%d\n",
+            sec, (unsigned long long)p->bytes_in, p->bytes_in / sec / 1e6,
+            (unsigned long long)p->records, p->records / sec, (unsigned long long)p->skipped,
+            (unsigned long long)p->written, p->reader_wait_ns / 1e9, p->writer_wait_ns / 1e9,
+            p->max_work, p->nbatches);
+    pthread_mutex_unlock(&p->lock);
+}
+
+struct stats_timer {
+    struct pipeline *p;
+    unsigned int interval;
+    uint64_t start;
+};
+
+static void *stats_thread(void *arg) {
+    struct stats_timer *st = arg;
+
+    while (!stop) {
+        sleep(st->interval);
+        print_stats(st->p, now_ns() - st->start);
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    printf("Usage: %s [-f ndjson|columnar] [-j workers] [-b batch_kb] [-o output] [-i stats_sec] <input>\n", name);
+}
+
+int main(int argc, char **argv) {
+    struct pipeline p;
+    struct stats_timer st;
+    struct sigaction sa;
+    struct stat sb;
+    pthread_t *workers, writer_tid, stats_tid;
+    const char *output = NULL;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt, i, nworkers = ncpu > 1 ? (int)ncpu - 1 : 1;
+    unsigned int interval = 0;
+    size_t batch_kb = DEFAULT_BATCH_KB;
+
+    memset(&p, 0, sizeof(p));
+    p.format = FMT_NDJSON;
+    while ((opt = getopt(argc, argv, "f:j:b:o:i:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (!strcmp(optarg, "ndjson"))
+                p.format = FMT_NDJSON;
+            else if (!strcmp(optarg, "columnar"))
+                p.format = FMT_COLUMNAR;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'j':
+            nworkers = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'b':
+            batch_kb = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'i':
+            interval = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    p.batch_size = (batch_kb ? batch_kb : DEFAULT_BATCH_KB) * 1024;
+    if (p.batch_size < MAX_POLL_READ * 4)
+        p.batch_size = MAX_POLL_READ * 4;
+
+    p.fd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY) : 0;
+    if (p.fd == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    p.is_device = !fstat(p.fd, &sb) && S_ISCHR(sb.st_mode);
+
+    p.out = output ? fopen(output, "wb") : stdout;
+    if (!p.out) {
+        perror(output);
+        close(p.fd);
+        return EXIT_FAILURE;
+    }
+    if (p.format == FMT_COLUMNAR && fwrite("FSMCOL2", 1, 8, p.out) != 8) {
+        perror("fwrite");
+        return EXIT_FAILURE;
+    }
+
+    /* two batches per worker keep workers busy while the writer catches up */
+    p.nbatches = nworkers * 2 + 2;
+    p.batches = calloc((size_t)p.nbatches, sizeof(struct batch));
+    p.free_list = calloc((size_t)p.nbatches, sizeof(struct batch *));
+    p.work = calloc((size_t)p.nbatches, sizeof(struct batch *));
+    p.by_seq = calloc((size_t)p.nbatches, sizeof(struct batch *));
+    workers = calloc((size_t)nworkers, sizeof(pthread_t));
+    if (!p.batches || !p.free_list || !p.work || !p.by_seq || !workers) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < p.nbatches; i++) {
+        p.batches[i].in.data = malloc(p.batch_size);
+        p.batches[i].in.cap = p.batch_size;
+        if (!p.batches[i].in.data) {
+            fprintf(stderr, "out of memory\n");
+            return EXIT_FAILURE;
+        }
+        p.free_list[p.nfree++] = &p.batches[i];
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.free_cond, NULL);
+    pthread_cond_init(&p.work_cond, NULL);
+    pthread_cond_init(&p.done_cond, NULL);
+
+    /* no SA_RESTART, so a blocked read returns on Ctrl-C */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    st.p = &p;
+    st.interval = interval;
+    st.start = now_ns();
+    for (i = 0; i < nworkers; i++)
+        pthread_create(&workers[i], NULL, worker, &p);
+    pthread_create(&writer_tid, NULL, writer, &p);
+    if (interval) {
+        pthread_create(&stats_tid, NULL, stats_thread, &st);
+        pthread_detach(stats_tid);
+    }
+
+    reader(&p);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
+    pthread_join(writer_tid, NULL);
+    if (fflush(p.out) || (p.out != stdout && fclose(p.out))) {
+        perror(output ? output : "stdout");
+        failed = 1;
+    }
+    print_stats(&p, now_ns() - st.start);
+
+    if (p.fd)
+        close(p.fd);
+    for (i = 0; i < p.nbatches; i++) {
+        free(p.batches[i].in.data);
+        free(p.batches[i].out.data);
+    }
+    free(p.batches);
+    free(p.free_list);
+    free(p.work);
+    free(p.by_seq);
+    free(workers);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
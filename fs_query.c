@@ -0,0 +1,834 @@
+/* per-file history over persisted fs_monitor events
+ *
+ * ingest: fs_query ingest <dir> /dev/fs_monitor
+ *         fs_query ingest <dir> < capture_file
+ *   a device is followed with poll() until SIGINT; only with overload=1
+ *   reads drain the ring and the history is complete, otherwise each wakeup
+ *   returns just the last event and events between wakeups are lost; don't
+ *   'cat' the device, a plain read of it returns a snapshot of the whole
+ *   ring; files and stdin are read until EOF
+ *
+ *   splits the stream into segments (seg-NNNNNN.log) and writes a sorted
+ *   path-hash index next to each of them (seg-NNNNNN.idx); a segment is
+ *   closed and becomes searchable after SEGMENT_MAX_AGE seconds, or earlier
+ *   if it grows too big; every event is indexed by its full path and by all
+ *   of its parent directories, and by its inode if the module runs with
+ *   path_dict=1; '@id' paths are resolved with '<path_def>' records before
+ *   they are stored, overload summaries get the path after their '@id'
+ *
+ * query:  fs_query file <dir> /srv/x
+ *         fs_query prefix <dir> /srv
+ *         fs_query inode <dir> 8:1:1234   (major:minor:ino)
+ *   indexes are mmap'd and binary searched, segments are scanned in
+ *   parallel by one thread per core
+ *
+ * build: cc -O2 -pthread -o fs_query fs_query.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "event_parse.h"
+
+#define IDX_MAGIC "FSMIDX1"
+#define IDX_VERSION 1
+
+#define READ_CHUNK (1 << 20)
+#define SEGMENT_MAX_ENTRIES (1 << 22)
+#define SEGMENT_MAX_BYTES (1U << 30)
+#define SEGMENT_MAX_AGE 60 /* seconds */
+#define POLL_TIMEOUT_MS 1000
+#define OVERLOAD_PARAM "/sys/module/fs_monitor/parameters/overload"
+#define SEG_NAME_LEN 4096
+
+struct idx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    int64_t first_ts, last_ts;
+};
+
+struct idx_entry {
+    uint64_t key;
+    int64_t ts;
+    uint32_t offset, length;
+};
+
+
+/* ingest */
+
+/* '@major:minor:ino:gen' -> path, filled from '<path_def>' records */
+struct path_map_slot {
+    char *id;
+    char *path;
+};
+
+struct path_map {
+    struct path_map_slot *slots;
+    size_t cap, count;
+};
+
+static struct path_map_slot *path_map_find(struct path_map *m, const char *id, size_t len) {
+    size_t i = (size_t)ev_hash(id, len) & (m->cap - 1);
+
+    while (m->slots[i].id && (strlen(m->slots[i].id) != len || memcmp(m->slots[i].id, id, len)))
+        i = (i + 1) & (m->cap - 1);
+    return &m->slots[i];
+}
+
+static const char *path_map_get(struct path_map *m, const char *id, size_t len) {
+    return m->cap ? path_map_find(m, id, len)->path : NULL;
+}
+
+static int path_map_set(struct path_map *m, const char *id, size_t id_len, const char *path, size_t path_len) {
+    struct path_map_slot *slot;
+    char *copy;
+
+    if ((m->count + 1) * 2 > m->cap) {
+        struct path_map old = *m;
+        size_t i;
+
+        m->cap = old.cap ? old.cap * 2 : 1024;
+        m->count = 0;
+        m->slots = calloc(m->cap, sizeof(struct path_map_slot));
+        if (!m->slots)
+            return -1;
+        for (i = 0; i < old.cap; i++) {
+            if (!old.slots[i].id)
+                continue;
+            *path_map_find(m, old.slots[i].id, strlen(old.slots[i].id)) = old.slots[i];
+            m->count++;
+        }
+        free(old.slots);
+    }
+
+    copy = malloc(path_len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, path, path_len);
+    copy[path_len] = '\0';
+
+    slot = path_map_find(m, id, id_len);
+    if (!slot->id) {
+        slot->id = malloc(id_len + 1);
+        if (!slot->id) {
+            free(copy);
+            return -1;
+        }
+        memcpy(slot->id, id, id_len);
+        slot->id[id_len] = '\0';
+        m->count++;
+    }
+    free(slot->path);
+    slot->path = copy;
+    return 0;
+}
+
+static void path_map_free(struct path_map *m) {
+    size_t i;
+    for (i = 0; i < m->cap; i++) {
+        free(m->slots[i].id);
+        free(m->slots[i].path);
+    }
+    free(m->slots);
+}
+
+struct segment_writer {
+    const char *dir;
+    unsigned int number;
+    FILE *log;
+    uint32_t offset;
+    struct idx_entry *entries;
+    size_t count, cap;
+    int64_t first_ts, last_ts;
+    time_t opened;
+    struct path_map paths;
+};
+
+static void seg_name(char *buf, const char *dir, unsigned int number, const char *ext) {
+    snprintf(buf, SEG_NAME_LEN, "%s/seg-%06u.%s", dir, number, ext);
+}
+
+/* "seg-NNNNNN.idx" -> NNNNNN, skips logs and unfinished indexes */
+static int seg_number(const char *name, unsigned int *number) {
+    size_t len = strlen(name);
+    if (len < 5 || strcmp(name + len - 4, ".idx"))
+        return -1;
+    return sscanf(name, "seg-%u.idx", number) == 1 ? 0 : -1;
+}
+
+/* returns the highest segment number found in 'dir', 0 if there are none */
+static unsigned int last_segment(const char *dir) {
+    unsigned int n, last = 0;
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (!d)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        if (!seg_number(de->d_name, &n) && n > last)
+            last = n;
+    }
+    closedir(d);
+    return last;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const struct idx_entry *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    if (x->ts != y->ts)
+        return x->ts < y->ts ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int seg_open(struct segment_writer *w) {
+    char name[SEG_NAME_LEN];
+
+    w->number++;
+    seg_name(name, w->dir, w->number, "log");
+    w->log = fopen(name, "wb");
+    if (!w->log) {
+        perror(name);
+        return -1;
+    }
+    w->offset = 0;
+    w->count = 0;
+    w->first_ts = w->last_ts = 0;
+    w->opened = time(NULL);
+    return 0;
+}
+
+static int seg_close(struct segment_writer *w) {
+    char name[SEG_NAME_LEN], tmp[SEG_NAME_LEN + 8];
+    struct idx_header hdr;
+    FILE *idx;
+
+    if (!w->log)
+        return 0;
+    if (fclose(w->log)) {
+        perror("fclose");
+        return -1;
+    }
+    w->log = NULL;
+
+    qsort(w->entries, w->count, sizeof(struct idx_entry), cmp_entry);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IDX_MAGIC, sizeof(IDX_MAGIC));
+    hdr.version = IDX_VERSION;
+    hdr.count = (uint32_t)w->count;
+    hdr.first_ts = w->first_ts;
+    hdr.last_ts = w->last_ts;
+
+    /* the index is published with rename so queries never see a partial one */
+    seg_name(name, w->dir, w->number, "idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    idx = fopen(tmp, "wb");
+    if (!idx) {
+        perror(tmp);
+        return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, idx) != 1 ||
+        fwrite(w->entries, sizeof(struct idx_entry), w->count, idx) != w->count) {
+        perror("fwrite");
+        fclose(idx);
+        return -1;
+    }
+    if (fclose(idx) || rename(tmp, name)) {
+        perror(name);
+        return -1;
+    }
+    return 0;
+}
+
+/* recent events are only searchable once their segment has an index */
+static int seg_rotate(struct segment_writer *w, uint32_t length) {
+    if (w->offset + (uint64_t)length > SEGMENT_MAX_BYTES || w->count >= SEGMENT_MAX_ENTRIES ||
+        (w->offset && time(NULL) - w->opened >= SEGMENT_MAX_AGE))
+        return seg_close(w) || seg_open(w) ? -1 : 0;
+    return 0;
+}
+
+static int seg_add_key(struct segment_writer *w, const char *s, size_t len, int64_t ts, uint32_t length) {
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        struct idx_entry *e = realloc(w->entries, cap * sizeof(struct idx_entry));
+        if (!e)
+            return -1;
+        w->entries = e;
+        w->cap = cap;
+    }
+    w->entries[w->count].key = ev_hash(s, len);
+    w->entries[w->count].ts = ts;
+    w->entries[w->count].offset = w->offset;
+    w->entries[w->count].length = length;
+    w->count++;
+    return 0;
+}
+
+/* index the path itself and every parent directory as "/a/", "/a/b/", ... */
+static int seg_index_path(struct segment_writer *w, const char *path, size_t len, int64_t ts, uint32_t length) {
+    size_t i;
+
+    if (seg_add_key(w, path, len, ts, length))
+        return -1;
+    for (i = 1; i < len; i++) {
+        if (path[i] == '/' && seg_add_key(w, path, i + 1, ts, length))
+            return -1;
+    }
+    return 0;
+}
+
+static int seg_write_record(struct segment_writer *w, const struct ev_record *in) {
+    struct ev_record rec = *in;
+    const char *path;
+    uint32_t length;
+    int i;
+
+    if (rec.type == EV_PATH_DEF)
+        return path_map_set(&w->paths, rec.field[2], rec.len[2], rec.field[3], rec.len[3]);
+
+    /* store the real path in place of '@id' and keep the id right after the base fields,
+     * summaries keep the id and get the path right after it */
+    if ((rec.type == EV_WRITE || rec.type == EV_SUMMARY) && rec.path_idx < 0 &&
+        rec.nfields < EV_MAX_FIELDS &&
+        (path = path_map_get(&w->paths, rec.field[rec.id_idx], rec.len[rec.id_idx])) != NULL) {
+        int at = rec.type == EV_WRITE ? 5 : 3;
+
+        for (i = rec.nfields; i > at; i--) {
+            rec.field[i] = rec.field[i - 1];
+            rec.len[i] = rec.len[i - 1];
+        }
+        rec.nfields++;
+        if (rec.type == EV_WRITE) {
+            rec.field[5] = rec.field[1];
+            rec.len[5] = rec.len[1];
+            rec.field[1] = path;
+            rec.len[1] = strlen(path);
+            rec.path_idx = 1;
+            rec.id_idx = 5;
+        } else {
+            rec.field[3] = path;
+            rec.len[3] = strlen(path);
+            rec.path_idx = 3;
+        }
+    }
+
+    length = (uint32_t)rec.nfields + 2;
+    for (i = 0; i < rec.nfields; i++)
+        length += (uint32_t)rec.len[i];
+
+    if (seg_rotate(w, length))
+        return -1;
+
+    if (rec.path_idx >= 0 &&
+        seg_index_path(w, rec.field[rec.path_idx], rec.len[rec.path_idx], rec.ts, length))
+        return -1;
+    if (rec.id_idx >= 0 &&
+        seg_add_key(w, rec.field[rec.id_idx], ev_inode_len(rec.field[rec.id_idx], rec.len[rec.id_idx]),
+                    rec.ts, length))
+        return -1;
+    if (rec.path_idx >= 0 || rec.id_idx >= 0) {
+        if (!w->first_ts || rec.ts < w->first_ts)
+            w->first_ts = rec.ts;
+        if (rec.ts > w->last_ts)
+            w->last_ts = rec.ts;
+    }
+
+    /* store records normalized: without poll padding */
+    for (i = 0; i < rec.nfields; i++) {
+        if (fputc('\0', w->log) == EOF ||
+            fwrite(rec.field[i], 1, rec.len[i], w->log) != rec.len[i]) {
+            perror("fwrite");
+            return -1;
+        }
+    }
+    if (fputc('\0', w->log) == EOF || fputc('\n', w->log) == EOF) {
+        perror("fwrite");
+        return -1;
+    }
+    w->offset += length;
+    return 0;
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+/* returns bytes read, 0 at the end of input or -1 on error; when following
+ * a device it waits for events and closes segments that got too old meanwhile */
+static ssize_t ingest_read(struct segment_writer *w, int fd, int follow, char *buf, size_t size) {
+    struct pollfd fds;
+    ssize_t len;
+    int n;
+
+    for (;;) {
+        if (stop)
+            return 0;
+        if (follow) {
+            fds.fd = fd;
+            fds.events = POLLIN;
+            n = poll(&fds, 1, POLL_TIMEOUT_MS);
+            if (n < 0 && errno != EINTR) {
+                perror("poll");
+                return -1;
+            }
+            if (n <= 0) {
+                if (seg_rotate(w, 0))
+                    return -1;
+                continue;
+            }
+        }
+
+        len = read(fd, buf, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            perror("read");
+        if (len == 0 && follow)
+            continue;
+        return len;
+    }
+}
+
+/* without overload=1 a polled read returns only the last event */
+static void check_draining_reads(void) {
+    char value = 'N';
+    FILE *f = fopen(OVERLOAD_PARAM, "r");
+
+    if (f) {
+        if (fread(&value, 1, 1, f) != 1)
+            value = 'N';
+        fclose(f);
+    }
+    if (value != 'Y' && value != '1')
+        fprintf(stderr, "warning: fs_monitor isn't loaded with overload=1, events between wakeups "
+                        "are lost and the history is incomplete\n");
+}
+
+static int do_ingest(const char *dir, const char *device) {
+    struct segment_writer w;
+    struct ev_record rec;
+    struct sigaction sa;
+    struct stat st;
+    char *buf;
+    size_t have = 0;
+    ssize_t len;
+    int ret = 0, fd = 0, follow;
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror(dir);
+        return EXIT_FAILURE;
+    }
+    if (device && (fd = open(device, O_RDONLY)) == -1) {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+    /* a capture file given instead of the device is read up to its end */
+    follow = device && !fstat(fd, &st) && S_ISCHR(st.st_mode);
+    if (follow)
+        check_draining_reads();
+
+    /* no SA_RESTART, so poll and read return on Ctrl-C and the last segment gets its index */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    memset(&w, 0, sizeof(w));
+    w.dir = dir;
+    w.number = last_segment(dir);
+    buf = malloc(READ_CHUNK);
+    if (!buf || seg_open(&w)) {
+        free(buf);
+        if (device)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+
+    while ((len = ingest_read(&w, fd, follow, buf + have, READ_CHUNK - have)) > 0) {
+        const char *p = buf, *end = buf + have + len, *nl;
+
+        while ((nl = ev_next_record(p, end)) != NULL) {
+            if (!ev_parse(&rec, p, nl) && seg_write_record(&w, &rec)) {
+                ret = -1;
+                break;
+            }
+            p = nl + 1;
+        }
+        if (ret)
+            break;
+
+        /* keep an incomplete record for the next read */
+        have = (size_t)(end - p);
+        if (have == READ_CHUNK) /* a single record can't be that big, drop garbage */
+            have = 0;
+        memmove(buf, p, have);
+    }
+    if (len < 0)
+        ret = -1;
+
+    if (seg_close(&w))
+        ret = -1;
+    if (device)
+        close(fd);
+    path_map_free(&w.paths);
+    free(w.entries);
+    free(buf);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* query */
+
+struct out_buf {
+    char *data;
+    size_t len, cap;
+};
+
+enum query_mode {
+    Q_FILE,
+    Q_PREFIX,
+    Q_INODE,
+};
+
+struct query {
+    const char *dir;
+    const char *key;      /* full path, directory with trailing '/' or '@major:minor:ino' */
+    size_t key_len;
+    int mode;
+    unsigned int *segments;
+    size_t nsegments;
+    struct out_buf *out;  /* one per segment, printed in order */
+    size_t next;          /* next segment to scan */
+    pthread_mutex_t mutex;
+};
+
+static int out_printf(struct out_buf *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int out_printf(struct out_buf *o, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(o->data + o->len, o->cap - o->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return -1;
+        if ((size_t)n < o->cap - o->len)
+            break;
+        o->cap = (o->cap + n + 1) * 2;
+        o->data = realloc(o->data, o->cap);
+        if (!o->data)
+            return -1;
+    }
+    o->len += n;
+    return 0;
+}
+
+static void format_record(struct out_buf *o, const struct ev_record *rec) {
+    int i, base;
+
+    switch (rec->type) {
+    case EV_WRITE:
+        out_printf(o, "%lld\twrite\t%.*s\tsize=%.*s", rec->ts,
+                   (int)rec->len[1], rec->field[1], (int)rec->len[3], rec->field[3]);
+        base = 5;
+        break;
+    case EV_UNLINK:
+        out_printf(o, "%lld\tunlink\t%.*s\tdev=%.*s", rec->ts,
+                   (int)rec->len[2], rec->field[2], (int)rec->len[1], rec->field[1]);
+        base = 4;
+        break;
+    case EV_SUMMARY:
+        if (rec->path_idx >= 0) {
+            out_printf(o, "%lld\tsummary\t%.*s\t%.*s", rec->ts, (int)rec->len[3], rec->field[3],
+                       (int)rec->len[2], rec->field[2]);
+            base = 4;
+        } else {
+            out_printf(o, "%lld\tsummary\t%.*s", rec->ts, (int)rec->len[2], rec->field[2]);
+            base = 3;
+        }
+        break;
+    default:
+        return;
+    }
+    /* anything past the base fields is printed as is */
+    for (i = base; i < rec->nfields; i++)
+        out_printf(o, "\t%.*s", (int)rec->len[i], rec->field[i]);
+    out_printf(o, "\n");
+}
+
+static int record_matches(const struct query *q, const struct ev_record *rec) {
+    const char *s;
+    size_t len;
+
+    if (q->mode == Q_INODE) {
+        if (rec->id_idx < 0)
+            return 0;
+        s = rec->field[rec->id_idx];
+        len = ev_inode_len(s, rec->len[rec->id_idx]);
+        return len == q->key_len && !memcmp(s, q->key, len);
+    }
+
+    if (rec->path_idx < 0)
+        return 0;
+    s = rec->field[rec->path_idx];
+    len = rec->len[rec->path_idx];
+    if (q->mode == Q_PREFIX)
+        return len > q->key_len && !memcmp(s, q->key, q->key_len);
+    return len == q->key_len && !memcmp(s, q->key, len);
+}
+
+static void *map_file(const char *name, size_t *size) {
+    struct stat st;
+    void *p;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    *size = (size_t)st.st_size;
+    return p;
+}
+
+static void scan_segment(struct query *q, size_t seg) {
+    char name[SEG_NAME_LEN];
+    const struct idx_header *hdr;
+    const struct idx_entry *e;
+    const char *log = NULL;
+    size_t idx_size, log_size = 0, lo, hi, mid;
+    uint64_t key = ev_hash(q->key, q->key_len);
+    struct ev_record rec;
+
+    seg_name(name, q->dir, q->segments[seg], "idx");
+    hdr = map_file(name, &idx_size);
+    if (!hdr)
+        return;
+    if (idx_size < sizeof(*hdr) || memcmp(hdr->magic, IDX_MAGIC, sizeof(IDX_MAGIC)) ||
+        hdr->version != IDX_VERSION ||
+        idx_size < sizeof(*hdr) + (size_t)hdr->count * sizeof(struct idx_entry)) {
+        fprintf(stderr, "%s: bad index\n", name);
+        goto unmap_idx;
+    }
+    e = (const struct idx_entry *)(hdr + 1);
+
+    lo = 0;
+    hi = hdr->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (e[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < hdr->count && e[lo].key == key; lo++) {
+        if (!log) {
+            seg_name(name, q->dir, q->segments[seg], "log");
+            log = map_file(name, &log_size);
+            if (!log)
+                break;
+        }
+        if ((size_t)e[lo].offset + e[lo].length > log_size)
+            continue;
+        /* hashes may collide, check the real path */
+        if (!ev_parse(&rec, log + e[lo].offset, log + e[lo].offset + e[lo].length - 1) &&
+            record_matches(q, &rec))
+            format_record(&q->out[seg], &rec);
+    }
+
+    if (log)
+        munmap((void *)log, log_size);
+unmap_idx:
+    munmap((void *)hdr, idx_size);
+}
+
+static void *query_worker(void *arg) {
+    struct query *q = arg;
+    size_t seg;
+
+    for (;;) {
+        pthread_mutex_lock(&q->mutex);
+        seg = q->next++;
+        pthread_mutex_unlock(&q->mutex);
+        if (seg >= q->nsegments)
+            break;
+        scan_segment(q, seg);
+    }
+    return NULL;
+}
+
+static int cmp_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int list_segments(struct query *q) {
+    unsigned int n;
+    size_t cap = 0;
+    struct dirent *de;
+    DIR *d = opendir(q->dir);
+
+    if (!d) {
+        perror(q->dir);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (seg_number(de->d_name, &n))
+            continue;
+        if (q->nsegments == cap) {
+            cap = cap ? cap * 2 : 64;
+            q->segments = realloc(q->segments, cap * sizeof(unsigned int));
+            if (!q->segments) {
+                closedir(d);
+                return -1;
+            }
+        }
+        q->segments[q->nsegments++] = n;
+    }
+    closedir(d);
+    qsort(q->segments, q->nsegments, sizeof(unsigned int), cmp_uint);
+    return 0;
+}
+
+static char *inode_key(const char *arg, size_t *len) {
+    unsigned int major, minor;
+    unsigned long ino;
+    char *key = malloc(64);
+
+    if (!key)
+        return NULL;
+    if (sscanf(arg, "%u:%u:%lu", &major, &minor, &ino) != 3) {
+        fprintf(stderr, "inode must be major:minor:ino\n");
+        free(key);
+        return NULL;
+    }
+    *len = (size_t)snprintf(key, 64, "@%u:%u:%lu", major, minor, ino);
+    return key;
+}
+
+static char *path_key(const char *path, size_t *len, int is_prefix) {
+    char *key;
+
+    *len = strlen(path);
+    if (*len == 0 || path[0] != '/') {
+        fprintf(stderr, "path must be absolute\n");
+        return NULL;
+    }
+
+    /* directories are indexed with a trailing '/' */
+    key = malloc(*len + 2);
+    if (!key)
+        return NULL;
+    memcpy(key, path, *len + 1);
+    while (*len > 1 && key[*len - 1] == '/')
+        key[--*len] = '\0';
+    if (is_prefix && *len == 1) {
+        fprintf(stderr, "refusing to dump the whole log, use a narrower prefix\n");
+        free(key);
+        return NULL;
+    }
+    if (is_prefix)
+        key[(*len)++] = '/';
+    return key;
+}
+
+static int do_query(const char *dir, const char *arg, int mode) {
+    struct query q;
+    pthread_t *threads;
+    char *key;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, nthreads, len;
+
+    key = mode == Q_INODE ? inode_key(arg, &len) : path_key(arg, &len, mode == Q_PREFIX);
+    if (!key)
+        return EXIT_FAILURE;
+
+    memset(&q, 0, sizeof(q));
+    q.dir = dir;
+    q.key = key;
+    q.key_len = len;
+    q.mode = mode;
+    pthread_mutex_init(&q.mutex, NULL);
+    if (list_segments(&q)) {
+        free(key);
+        return EXIT_FAILURE;
+    }
+    q.out = calloc(q.nsegments ? q.nsegments : 1, sizeof(struct out_buf));
+
+    nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+    if (nthreads > q.nsegments)
+        nthreads = q.nsegments ? q.nsegments : 1;
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (!q.out || !threads) {
+        free(q.out);
+        free(threads);
+        free(q.segments);
+        free(key);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, query_worker, &q)) {
+            nthreads = i;
+            break;
+        }
+    }
+    if (nthreads == 0)
+        query_worker(&q);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < q.nsegments; i++) {
+        if (q.out[i].len)
+            fwrite(q.out[i].data, 1, q.out[i].len, stdout);
+        free(q.out[i].data);
+    }
+
+    pthread_mutex_destroy(&q.mutex);
+    free(threads);
+    free(q.out);
+    free(q.segments);
+    free(key);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "ingest"))
+        return do_ingest(argv[2], argc == 4 ? argv[3] : NULL);
+    if (argc == 4 && !strcmp(argv[1], "file"))
+        return do_query(argv[2], argv[3], Q_FILE);
+    if (argc == 4 && !strcmp(argv[1], "prefix"))
+        return do_query(argv[2], argv[3], Q_PREFIX);
+    if (argc == 4 && !strcmp(argv[1], "inode"))
+        return do_query(argv[2], argv[3], Q_INODE);
+
+    printf("Usage: %s ingest <dir> [<device>]   (follows the device or reads stdin)\n"
+           "       %s file <dir> <path>\n"
+           "       %s prefix <dir> <directory>\n"
+           "       %s inode <dir> <major:minor:ino>\n", argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
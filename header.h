@@ -18,6 +18,7 @@
 
 /* init */
 #define KPROBES_MAX_COUNT 10
+#define KRETPROBES_MAX_COUNT 4
 
 extern struct kprobe **kp;
 
@@ -25,11 +26,13 @@ extern struct kprobe **kp;
 /* buffers */
 #define COPY_BUF_SIZE 40
 #define BASE64_ENCODED_MAX 60
+#define FILE_ID_SIZE 48
 
 
 /* ring buffer */
 #define ENTRY_SIZE 512
-#define ENTRY_MAX_CNT_SIZE 10
+#define MONITOR_ENTRY_SIZE (2 * ENTRY_SIZE) /* event and its path definition */
+#define ENTRY_MAX_CNT_SIZE 16
 #define SPEC_STRINGS_SIZE 30
 
 struct ring_buffer {
@@ -43,6 +46,7 @@ void ring_buffer_destroy(struct ring_buffer *buffer);
 void ring_buffer_clear(struct ring_buffer *buffer);
 void ring_buffer_rread(struct ring_buffer *buffer, char *output); /* 'ring_buffer_read' already taken by old kernels, so we use 'ring_buffer_rread' */
 void ring_buffer_append(struct ring_buffer *buffer, const char *values, size_t length);
+ssize_t ring_buffer_consume(struct ring_buffer *buffer, char *output, size_t max);
 
 
 /* chardev */
@@ -64,12 +68,46 @@ int base64_encode(const u8 *src, int len, char *dst);
 int base64_decode(const char *src, int len, u8 *dst);
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+static inline s64 ktime_get_ns(void) {
+    return ktime_to_ns(ktime_get()); /* 'ktime_get_ns' was added with 'linux/timekeeping.h' header in 3.17-rc1 */
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+#include <linux/vmalloc.h>
+static inline void *vzalloc(unsigned long size) {
+    void *p = vmalloc(size); /* 'vzalloc' was added in 2.6.37-rc1 */
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
+#define PDE_DATA(inode) (PDE(inode)->data) /* 'PDE_DATA' was added in 3.10-rc1 */
+#endif
+
+#ifndef U64_MAX
+#define U64_MAX ((u64)~0ULL)
+#endif
+
 
 /* service */
 int kisdigit(char c);
 inline int is_regular(struct dentry *dentry);
 
 int copy_start_middle(char *to, const char *from, size_t count, int middle);
+struct iov_iter;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+int copy_start_middle_iter(char *to, struct iov_iter *from, size_t count, int middle);
+#else
+static inline int copy_start_middle_iter(char *to, struct iov_iter *from, size_t count, int middle) {
+    return 0; /* no iter-based write probe before 4.1 */
+}
+#endif
 size_t entry_combiner(char *entry, const char **to_be_entry, size_t cnt);
 void free_ptr_array(void **ptr_array, size_t count);
 
@@ -77,15 +115,157 @@ char *own_dentry_path(struct dentry *dentry, char *buf, int buflen);
 void own_bdevname(struct block_device *bdev, char *buf);
 
 
+/* attribution */
+#define CGROUP_FILTER_MAX 16
+
+extern bool attribution;
+
+u64 current_cgroup_id(void);
+int cgroup_filtered(void);
+void current_comm(char *buf);
+size_t append_field(char **to_be_entry, size_t cnt, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+size_t append_attribution(char **to_be_entry, size_t cnt);
+
+
+/* file identity, survives the inode itself */
+struct file_key {
+    dev_t dev;
+    unsigned long ino;
+    u32 gen;
+};
+
+void file_key_init(struct file_key *key, struct inode *inode);
+int file_key_id(struct file_key *key, char *buf);
+int file_id(struct inode *inode, char *buf);
+
+/* names a file (or a writer) only when it's needed, see 'topk_label_*' */
+typedef void (*topk_label_fn)(void *arg, char *buf, size_t len);
+
+
 /* tracers */
 int vfs_write_trace(struct kprobe *p, struct pt_regs *regs);
 int vfs_unlink_trace(struct kprobe *p, struct pt_regs *regs);
 int vfs_rename_trace(struct kprobe *p, struct pt_regs *regs);
 int vfs_copy_trace(struct kprobe *p, struct pt_regs *regs);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+int write_iter_trace(struct kprobe *p, struct pt_regs *regs);
+#endif
+
+/* entry/return pairs, state is kept in 'kretprobe_instance->data' */
+struct op_result {
+    ssize_t ret;
+    s64 latency;
+};
+
+struct write_call {
+    struct file *file;
+    const char __user *buf;
+    loff_t pos;
+    s64 ts;
+};
+
+struct unlink_call {
+    struct super_block *sb;
+    struct file_key key;
+    char *path, *id;
+    s64 ts;
+    char path_buf[MAX_PATH_LEN];
+    char id_buf[FILE_ID_SIZE];
+};
+
+struct kretprobe_instance;
+int vfs_write_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int vfs_write_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int vfs_unlink_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int vfs_unlink_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+
+extern bool iter_hook;
+extern bool ret_probes;
+extern bool drop_failed;
+extern bool stream;
 
 extern int data_available;
 extern spinlock_t lock;
-extern char monitor_entry[ENTRY_SIZE];
+extern char monitor_entry[MONITOR_ENTRY_SIZE];
+extern size_t monitor_entry_len;
+extern int monitor_entry_def;
+
+
+/* path dictionary */
+#define PATH_DICT_SIZE 4096 /* must be a power of 2 */
+
+extern bool path_dict;
+
+void path_dict_clear(void);
+int path_dict_insert(struct inode *inode);
+void path_dict_forget(struct inode *inode);
+
+
+/* overload mode */
+#define AGG_TABLE_SIZE 1024 /* must be a power of 2 */
+#define AGG_MAX_PROBES 16
+
+extern bool overload;
+
+int overload_write(struct file_key *key, size_t bytes, s64 ts, topk_label_fn label, void *arg);
+int overload_unlink(struct file_key *key, s64 ts, topk_label_fn label, void *arg);
+void overload_flush(void);
+void overload_destroy(void);
+
+
+/* latency histograms, log2 buckets in ns */
+#define LAT_BUCKETS 40
+#define LAT_FS_MAX 16
+#define LAT_FS_NAME_LEN 32
+#define LATENCY_PROC_NAME "fs_monitor_latency"
+
+enum {
+    LAT_WRITE,
+    LAT_UNLINK,
+    LAT_OPS,
+};
+
+struct file_system_type;
+struct seq_file;
+void latency_record(struct file_system_type *fs, int op, s64 ns);
+int latency_show(struct seq_file *m, void *v);
+
+/* probe cost, time spent in write handlers */
+enum {
+    COST_VFS_WRITE,
+    COST_WRITE_ITER,
+    COST_PROBES,
+};
+
+extern bool probe_cost;
+void probe_cost_record(int probe, u64 start);
+
+
+/* heavy hitters */
+#define TOPK_DEPTH 4
+#define TOPK_WIDTH 256 /* must be a power of 2 */
+#define TOPK_CAND 64   /* per CPU */
+#define TOPK_SHOW 50
+#define TOPK_LABEL_LEN 128
+#define TOPK_PROC_NAME "fs_monitor_top"
+
+enum {
+    TOPK_FILES,
+    TOPK_WRITERS,
+    TOPK_SPACES,
+};
+
+extern bool topk;
+
+int topk_init(void);
+void topk_destroy(void);
+void topk_account_file(struct file_key *key, u64 bytes, topk_label_fn label, void *arg);
+void topk_account_writer(u64 bytes);
+void topk_label_string(void *arg, char *buf, size_t len);
+void topk_label_file(void *arg, char *buf, size_t len);
+void topk_label_dentry(void *arg, char *buf, size_t len);
+int topk_show(struct seq_file *m, void *v);
 
 
 /* poll */
@@ -3,6 +3,7 @@
 #include <linux/file.h>
 #include <linux/poll.h>
 #include <linux/device.h>
+#include <linux/seq_file.h>
 #include "header.h"
 
 /* define cross-file variables */
@@ -20,27 +21,57 @@ static int major;
 
 static int kpc = 0;
 
+/* entry/return pairs */
+static struct kretprobe krp[KRETPROBES_MAX_COUNT];
+static struct kretprobe *krp_list[KRETPROBES_MAX_COUNT];
+static int krpc = 0;
+
+static struct proc_dir_entry *latency_entry = NULL;
+static struct proc_dir_entry *topk_entry = NULL;
+
 ssize_t chardev_read(struct file *file, char __user *buffer, size_t count, loff_t *pos) {
     ssize_t ret;
+    char *out_buffer;
+
+    if (overload) {
+        /* in overload mode readers drain the buffer, whole records only;
+         * pending aggregates are flushed before and after the drain */
+        out_buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+        if (!out_buffer)
+            return -ENOMEM;
+
+        overload_flush();
+        ret = ring_buffer_consume(rbuf, out_buffer, count < BUFFER_SIZE ? count : BUFFER_SIZE);
+        if (ret > 0 && copy_to_user(buffer, out_buffer, ret))
+            ret = -EFAULT;
+        kfree(out_buffer);
+
+        polled = 0;
+        overload_flush();
+        return ret;
+    }
 
     if (*pos > 0)
         return 0;
 
     if (polled) {
-        /* simply get last event from global variable event */
-        if (copy_to_user(buffer, monitor_entry, count < ENTRY_SIZE ? count : ENTRY_SIZE)) {
+        /* simply get last event from global variable event,
+         * it may be longer than ENTRY_SIZE if it carries a path definition */
+        size_t len = monitor_entry_len > ENTRY_SIZE ? monitor_entry_len : ENTRY_SIZE;
+
+        if (copy_to_user(buffer, monitor_entry, count < len ? count : len)) {
             ret = -EFAULT;
             goto exit;
         }
 
-        ret = (ssize_t)ENTRY_SIZE;
+        ret = (ssize_t)len;
         *pos = 0; // drop position because polling always starts from the beginning
         polled = 0;
+        monitor_entry_def = 0;
     } else {
-        char *out_buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+        out_buffer = kmalloc(BUFFER_SIZE + 1, GFP_KERNEL); /* 'ring_buffer_rread' adds '\0' */
         if (!out_buffer) {
             ret = -ENOMEM;
-            kfree(out_buffer);
             goto exit;
         }
 
@@ -50,6 +81,7 @@ ssize_t chardev_read(struct file *file, char __user *buffer, size_t count, loff_
             ret = -EFAULT;
             goto exit;
         }
+        kfree(out_buffer);
 
         ret = (ssize_t)rbuf->size;
         *pos = (loff_t)rbuf->size;
@@ -59,9 +91,16 @@ exit:
     return ret;
 }
 
+static int chardev_open(struct inode *inode, struct file *file) {
+    /* new reader knows no paths yet */
+    if (path_dict)
+        path_dict_clear();
+    return 0;
+}
+
 static unsigned int chardev_poll(struct file *file, poll_table *wait) {
     poll_wait(file, &wait_queue, wait);
-    if (data_available) {
+    if (data_available || (overload && rbuf->size)) {
         polled = 1;
         data_available = 0;
         return POLLIN | POLLRDNORM;
@@ -70,6 +109,7 @@ static unsigned int chardev_poll(struct file *file, poll_table *wait) {
 }
 
 const struct file_operations chardev_fops = {
+        .open = chardev_open,
         .read = chardev_read,
         .poll = chardev_poll,
 };
@@ -86,18 +126,72 @@ static char *tracer_devnode(const struct device *dev, umode_t *mode) {
     return NULL;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+static int stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, PDE_DATA(inode), NULL);
+}
+
+static const struct file_operations stats_fops = {
+        .owner = THIS_MODULE,
+        .open = stats_open,
+        .read = seq_read,
+        .llseek = seq_lseek,
+        .release = single_release,
+};
+#endif
+
+/* read-only /proc file printed by 'show', statistics are optional,
+ * so the module works without them */
+static struct proc_dir_entry *create_stats_entry(const char *name, int (*show)(struct seq_file *, void *)) {
+    struct proc_dir_entry *entry;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+    entry = proc_create_data(name, 0444, NULL, &stats_fops, show);
+#else
+    entry = proc_create_single(name, 0444, NULL, show);
+#endif
+    if (!entry)
+        printk(KERN_INFO "Failed to create /proc/%s\n", name);
+    return entry;
+}
+
+static void add_kretprobe(const char *symbol_name, kretprobe_handler_t entry_handler,
+                          kretprobe_handler_t handler, size_t data_size) {
+    krp[krpc].kp.symbol_name = symbol_name;
+    krp[krpc].entry_handler = entry_handler;
+    krp[krpc].handler = handler;
+    krp[krpc].data_size = data_size;
+    /* both functions may sleep, so there can be many calls in flight per CPU */
+    krp[krpc].maxactive = 16 * num_possible_cpus();
+    krp_list[krpc] = &krp[krpc];
+    krpc++;
+}
+
 static int __init my_kprobe_init(void) {
     int ret, i;
 
+    /* attempts seen at generic_write_checks can't be paired with vfs_write returns */
+    if (iter_hook && ret_probes) {
+        pr_err("iter_hook and ret_probes can't be used together\n");
+        return -EINVAL;
+    }
+
     rbuf = kmalloc(sizeof(struct ring_buffer), GFP_KERNEL);
     if (!rbuf) {
         return -ENOMEM;
     }
     ring_buffer_init(rbuf);
 
+    ret = topk_init();
+    if (ret < 0) {
+        ring_buffer_destroy(rbuf);
+        return ret;
+    }
+
     major = register_chrdev(0, DEVNAME, &chardev_fops);
     if (major < 0) {
         ring_buffer_destroy(rbuf);
+        topk_destroy();
         return -ENOMEM;
     }
 
@@ -109,6 +203,7 @@ static int __init my_kprobe_init(void) {
     if (IS_ERR(tracer_class)) {
         unregister_chrdev(major, DEVNAME);
         ring_buffer_destroy(rbuf);
+        topk_destroy();
         pr_err("Failed to register device class\n");
         return PTR_ERR(tracer_class);
     }
@@ -119,6 +214,7 @@ static int __init my_kprobe_init(void) {
         class_destroy(tracer_class);
         unregister_chrdev(major, DEVNAME);
         ring_buffer_destroy(rbuf);
+        topk_destroy();
         pr_err("Failed to create the device\n");
         return PTR_ERR(tracer_device);
     }
@@ -131,6 +227,7 @@ static int __init my_kprobe_init(void) {
         if (!kp[i]) {
             free_ptr_array((void **)kp, i);
             ring_buffer_destroy(rbuf);
+            topk_destroy();
             device_destroy(tracer_class, MKDEV(major, 0));
             class_destroy(tracer_class);
             unregister_chrdev(major, DEVNAME);
@@ -142,10 +239,27 @@ static int __init my_kprobe_init(void) {
         memset(kp[i], 0, sizeof(struct kprobe));
     }
 
-    kp[kpc]->symbol_name = "vfs_write";
-    kp[kpc++]->pre_handler = vfs_write_trace;
-    kp[kpc]->symbol_name = "vfs_unlink";
-    kp[kpc++]->pre_handler = vfs_unlink_trace;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+    if (iter_hook) {
+        /* one probe below all write syscalls, it replaces vfs_write ones */
+        kp[kpc]->symbol_name = "generic_write_checks";
+        kp[kpc++]->pre_handler = write_iter_trace;
+    } else
+#endif
+    if (ret_probes) {
+        /* paired probes replace plain ones for the same functions */
+        add_kretprobe("vfs_write", vfs_write_entry, vfs_write_ret, sizeof(struct write_call));
+    } else {
+        kp[kpc]->symbol_name = "vfs_write";
+        kp[kpc++]->pre_handler = vfs_write_trace;
+    }
+
+    if (ret_probes) {
+        add_kretprobe("vfs_unlink", vfs_unlink_entry, vfs_unlink_ret, sizeof(struct unlink_call));
+    } else {
+        kp[kpc]->symbol_name = "vfs_unlink";
+        kp[kpc++]->pre_handler = vfs_unlink_trace;
+    }
     kp[kpc]->symbol_name = "vfs_rename";
     kp[kpc++]->pre_handler = vfs_rename_trace;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
@@ -160,19 +274,46 @@ static int __init my_kprobe_init(void) {
         printk(KERN_INFO "Failed to register kprobe: %d\n", ret);
         free_ptr_array((void **)kp, KPROBES_MAX_COUNT);
         ring_buffer_destroy(rbuf);
+        topk_destroy();
         device_destroy(tracer_class, MKDEV(major, 0));
         class_destroy(tracer_class);
         unregister_chrdev(major, DEVNAME);
         return ret;
     }
 
+    if (krpc) {
+        ret = register_kretprobes(krp_list, krpc);
+        if (ret < 0) {
+            printk(KERN_INFO "Failed to register kretprobe: %d\n", ret);
+            unregister_kprobes(kp, kpc);
+            free_ptr_array((void **)kp, KPROBES_MAX_COUNT);
+            ring_buffer_destroy(rbuf);
+            topk_destroy();
+            device_destroy(tracer_class, MKDEV(major, 0));
+            class_destroy(tracer_class);
+            unregister_chrdev(major, DEVNAME);
+            return ret;
+        }
+    }
+
+    latency_entry = create_stats_entry(LATENCY_PROC_NAME, latency_show);
+    topk_entry = create_stats_entry(TOPK_PROC_NAME, topk_show);
+
     return 0;
 }
 
 static void __exit my_kprobe_exit(void) {
+    if (topk_entry)
+        remove_proc_entry(TOPK_PROC_NAME, NULL);
+    if (latency_entry)
+        remove_proc_entry(LATENCY_PROC_NAME, NULL);
+    if (krpc)
+        unregister_kretprobes(krp_list, krpc);
     unregister_kprobes(kp, kpc);
     free_ptr_array((void **)kp, KPROBES_MAX_COUNT);
     ring_buffer_destroy(rbuf);
+    topk_destroy();
+    overload_destroy();
     device_destroy(tracer_class, MKDEV(major, 0));
     class_destroy(tracer_class);
     unregister_chrdev(major, DEVNAME);
@@ -0,0 +1,232 @@
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include "header.h"
+
+/* overload mode: when the ring buffer is filled above 'overload_high' percent,
+ * events stop going to it and are aggregated per inode instead; aggregates
+ * are flushed as '<summary>' records once readers drain the buffer below
+ * 'overload_low' percent, the degraded period is marked with
+ * '<overload_begin>' and '<overload_end>' records; the path of every file is
+ * resolved once, when it enters the table, and sent with its summary
+ */
+bool overload = 0;
+module_param(overload, bool, 0444);
+MODULE_PARM_DESC(overload, "Aggregate events per inode instead of overwriting them when the buffer is nearly full, reads drain the buffer");
+
+static uint overload_high = 75;
+module_param(overload_high, uint, 0644);
+MODULE_PARM_DESC(overload_high, "Buffer fill percentage to enter overload mode");
+
+static uint overload_low = 25;
+module_param(overload_low, uint, 0644);
+MODULE_PARM_DESC(overload_low, "Buffer fill percentage to flush aggregates and leave overload mode");
+
+struct agg_entry {
+    struct file_key key;
+    u64 writes, bytes;
+    s64 first, last, unlinked;
+    char *path; /* NULL if it couldn't be resolved */
+    int used;
+    int flushed; /* slot stays taken until the whole table is flushed */
+};
+
+static struct agg_entry agg_table[AGG_TABLE_SIZE];
+static size_t agg_pending = 0;
+static u64 agg_events = 0, agg_dropped = 0;
+static int degraded = 0;
+static DEFINE_SPINLOCK(agg_lock);
+
+static inline size_t watermark(uint percent) {
+    return (size_t)BUFFER_SIZE / 100 * min(percent, 100U);
+}
+
+static inline int key_equal(struct file_key *a, struct file_key *b) {
+    return a->ino == b->ino && a->dev == b->dev && a->gen == b->gen;
+}
+
+/* overload marker: timestamp, tag, optional counters */
+static void append_marker(const char *tag, s64 ts, int with_counters) {
+    char entry[ENTRY_SIZE], ts_str[SPEC_STRINGS_SIZE], events[SPEC_STRINGS_SIZE], dropped[SPEC_STRINGS_SIZE];
+    const char *to_be_entry[4];
+
+    sprintf(ts_str, "%lld", ts);
+    to_be_entry[0] = ts_str;
+    to_be_entry[1] = tag;
+    if (with_counters) {
+        sprintf(events, "events=%llu", agg_events);
+        sprintf(dropped, "dropped=%llu", agg_dropped);
+        to_be_entry[2] = events;
+        to_be_entry[3] = dropped;
+    }
+    ring_buffer_append(rbuf, entry, entry_combiner(entry, to_be_entry, with_counters ? 4 : 2));
+}
+
+static void agg_reset(struct agg_entry *e) {
+    kfree(e->path);
+    memset(e, 0, sizeof(*e));
+}
+
+/* resolved with the same helpers as top-K labels, failures give no path */
+static char *agg_path(topk_label_fn label, void *arg) {
+    char buf[MAX_PATH_LEN];
+
+    label(arg, buf, MAX_PATH_LEN);
+    return buf[0] == '/' ? kstrdup(buf, GFP_ATOMIC) : NULL;
+}
+
+/* must be called with 'agg_lock' held, returns NULL if the table is too crowded */
+static struct agg_entry *agg_get(struct file_key *key, s64 ts, topk_label_fn label, void *arg) {
+    size_t i, idx = hash_long(key->ino ^ key->dev, ilog2(AGG_TABLE_SIZE));
+    struct agg_entry *e;
+
+    for (i = 0; i < AGG_MAX_PROBES; i++) {
+        e = &agg_table[(idx + i) & (AGG_TABLE_SIZE - 1)];
+        if (e->used && !key_equal(&e->key, key))
+            continue;
+        if (!e->used || e->flushed) {
+            agg_reset(e);
+            e->key = *key;
+            e->path = agg_path(label, arg);
+            e->first = ts;
+            e->used = 1;
+            agg_pending++;
+        }
+        return e;
+    }
+    return NULL;
+}
+
+/* must be called with 'agg_lock' held, returns 1 if events must be aggregated */
+static int overload_enter(s64 ts) {
+    if (!overload)
+        return 0;
+    if (!degraded) {
+        if (rbuf->size < watermark(overload_high))
+            return 0;
+        degraded = 1;
+        agg_events = agg_dropped = 0;
+        append_marker("<overload_begin>", ts, 0);
+    }
+    agg_events++;
+    return 1;
+}
+
+/* returns 1 if the write was aggregated and mustn't be reported */
+int overload_write(struct file_key *key, size_t bytes, s64 ts, topk_label_fn label, void *arg) {
+    struct agg_entry *e;
+    int ret = 0;
+
+    if (!overload && !degraded)
+        return 0;
+
+    spin_lock(&agg_lock);
+    if (overload_enter(ts)) {
+        e = agg_get(key, ts, label, arg);
+        if (e) {
+            e->writes++;
+            e->bytes += bytes;
+            e->last = ts;
+        } else
+            agg_dropped++;
+        ret = 1;
+    }
+    spin_unlock(&agg_lock);
+
+    return ret;
+}
+EXPORT_SYMBOL(overload_write);
+
+/* returns 1 if the unlink was aggregated and mustn't be reported */
+int overload_unlink(struct file_key *key, s64 ts, topk_label_fn label, void *arg) {
+    struct agg_entry *e;
+    int ret = 0;
+
+    if (!overload && !degraded)
+        return 0;
+
+    spin_lock(&agg_lock);
+    if (overload_enter(ts)) {
+        e = agg_get(key, ts, label, arg);
+        if (e) {
+            e->unlinked = ts;
+            e->last = ts;
+        } else
+            agg_dropped++;
+        ret = 1;
+    }
+    spin_unlock(&agg_lock);
+
+    return ret;
+}
+EXPORT_SYMBOL(overload_unlink);
+
+/* summary: timestamp, "<summary>", '@major:minor:ino:gen', path if it's known,
+ * 'writes=', 'bytes=', 'first=', 'last=', 'unlinked=' (0 if the file wasn't unlinked) */
+static size_t summary_combiner(char *entry, struct agg_entry *e, s64 ts) {
+    char fields[8][SPEC_STRINGS_SIZE + FILE_ID_SIZE];
+    const char *to_be_entry[9];
+    int i, cnt = 0;
+
+    sprintf(fields[0], "%lld", ts);
+    sprintf(fields[1], "<summary>");
+    file_key_id(&e->key, fields[2]);
+    sprintf(fields[3], "writes=%llu", e->writes);
+    sprintf(fields[4], "bytes=%llu", e->bytes);
+    sprintf(fields[5], "first=%lld", e->first);
+    sprintf(fields[6], "last=%lld", e->last);
+    sprintf(fields[7], "unlinked=%lld", e->unlinked);
+    for (i = 0; i < 8; i++) {
+        to_be_entry[cnt++] = fields[i];
+        if (i == 2 && e->path)
+            to_be_entry[cnt++] = e->path;
+    }
+
+    return entry_combiner(entry, to_be_entry, cnt);
+}
+
+/* called by readers after draining the buffer */
+void overload_flush(void) {
+    static char entry[MONITOR_ENTRY_SIZE]; /* protected by 'agg_lock', a path may take most of it */
+    size_t i, r;
+    s64 ts;
+
+    if (!degraded || rbuf->size > watermark(overload_low))
+        return;
+
+    ts = ktime_get_ns();
+    spin_lock(&agg_lock);
+    for (i = 0; i < AGG_TABLE_SIZE && agg_pending; i++) {
+        if (!agg_table[i].used || agg_table[i].flushed)
+            continue;
+        r = summary_combiner(entry, &agg_table[i], ts);
+        /* the rest goes with the next read */
+        if (rbuf->size + r > watermark(overload_high))
+            break;
+        ring_buffer_append(rbuf, entry, r);
+        agg_table[i].flushed = 1;
+        agg_pending--;
+    }
+    if (!agg_pending) {
+        for (i = 0; i < AGG_TABLE_SIZE; i++)
+            agg_reset(&agg_table[i]);
+        append_marker("<overload_end>", ts, 1);
+        degraded = 0;
+    }
+    spin_unlock(&agg_lock);
+
+    if (!data_available) {
+        data_available = 1;
+        wake_up_interruptible(&wait_queue);
+    }
+}
+EXPORT_SYMBOL(overload_flush);
+
+void overload_destroy(void) {
+    size_t i;
+
+    spin_lock(&agg_lock);
+    for (i = 0; i < AGG_TABLE_SIZE; i++)
+        agg_reset(&agg_table[i]);
+    spin_unlock(&agg_lock);
+}
+EXPORT_SYMBOL(overload_destroy);
@@ -1,6 +1,12 @@
 #include <linux/fs.h>
 #include <linux/fs_struct.h>
 #include <linux/mount.h>
+#include <linux/hash.h>
+#include <linux/sched.h>
+#include <linux/cgroup.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
 #include "header.h"
 
 /* for device name resolving */
@@ -17,6 +23,17 @@
 /* for ring buffer operations */
 DEFINE_SPINLOCK(lock);
 
+/* cgroup filter, checked before any other work in tracers */
+static unsigned long long cgroup_allow[CGROUP_FILTER_MAX];
+static int cgroup_allow_cnt = 0;
+module_param_array(cgroup_allow, ullong, &cgroup_allow_cnt, 0644);
+MODULE_PARM_DESC(cgroup_allow, "Trace only these cgroup ids (cgroup v2 directory inode numbers)");
+
+static unsigned long long cgroup_deny[CGROUP_FILTER_MAX];
+static int cgroup_deny_cnt = 0;
+module_param_array(cgroup_deny, ullong, &cgroup_deny_cnt, 0644);
+MODULE_PARM_DESC(cgroup_deny, "Don't trace these cgroup ids");
+
 int kisdigit(char c) {
     return c >= '0' && c <= '9';
 }
@@ -43,21 +60,37 @@ void ring_buffer_clear(struct ring_buffer *buffer) {
 }
 EXPORT_SYMBOL(ring_buffer_clear);
 
-void ring_buffer_append(struct ring_buffer *buffer, const char *values, size_t length) {
-    size_t i;
+/* drop whole records from the head, so the buffer always starts with a record */
+static void ring_buffer_make_room(struct ring_buffer *buffer, size_t length) {
+    char c;
 
-    spin_lock(&lock);
-    for (i = 0; i < length; i++) {
-        if (buffer->size < BUFFER_SIZE) {
-            buffer->data[buffer->tail] = values[i];
-            buffer->tail = (buffer->tail + 1) % BUFFER_SIZE;
-            buffer->size++;
-        } else {
-            buffer->data[buffer->tail] = values[i];
-            buffer->tail = (buffer->tail + 1) % BUFFER_SIZE;
+    /* in overload mode the ring is drained by readers, so dropped records
+     * may carry path definitions they haven't got yet */
+    if (path_dict && overload && buffer->size + length > BUFFER_SIZE)
+        path_dict_clear();
+
+    while (buffer->size && buffer->size + length > BUFFER_SIZE) {
+        do {
+            c = buffer->data[buffer->head];
             buffer->head = (buffer->head + 1) % BUFFER_SIZE;
-        }
+            buffer->size--;
+        } while (c != '\n' && buffer->size);
     }
+}
+
+void ring_buffer_append(struct ring_buffer *buffer, const char *values, size_t length) {
+    size_t first;
+
+    if (length > BUFFER_SIZE)
+        return;
+
+    spin_lock(&lock);
+    ring_buffer_make_room(buffer, length);
+    first = min(length, (size_t)(BUFFER_SIZE - buffer->tail));
+    memcpy(buffer->data + buffer->tail, values, first);
+    memcpy(buffer->data, values + first, length - first);
+    buffer->tail = (buffer->tail + length) % BUFFER_SIZE;
+    buffer->size += length;
     spin_unlock(&lock);
 }
 EXPORT_SYMBOL(ring_buffer_append);
@@ -72,6 +105,33 @@ void ring_buffer_rread(struct ring_buffer *buffer, char *output) {
 }
 EXPORT_SYMBOL(ring_buffer_rread);
 
+/* move up to 'max' bytes of whole records to 'output', returns bytes moved
+ * or -EINVAL if the first record doesn't fit, so readers don't take it for EOF */
+ssize_t ring_buffer_consume(struct ring_buffer *buffer, char *output, size_t max) {
+    size_t idx, i, len = 0;
+    int empty;
+
+    spin_lock(&lock);
+    if (max > buffer->size)
+        max = buffer->size;
+    idx = buffer->head;
+    for (i = 0; i < max; i++) {
+        output[i] = buffer->data[idx];
+        idx = (idx + 1) % BUFFER_SIZE;
+        if (output[i] == '\n')
+            len = i + 1;
+    }
+    buffer->head = (buffer->head + len) % BUFFER_SIZE;
+    buffer->size -= len;
+    empty = !buffer->size;
+    spin_unlock(&lock);
+
+    if (!len && !empty)
+        return -EINVAL;
+    return (ssize_t)len;
+}
+EXPORT_SYMBOL(ring_buffer_consume);
+
 inline int is_regular(struct dentry *dentry) {
     /* any fs without device is considered a service fs
      * yes, we'll lose some fs like NFS or curlftpfs
@@ -88,19 +148,49 @@ EXPORT_SYMBOL(is_regular);
 // copy 40 bytes from the middle of 'from' to 'to'
 int copy_start_middle(char *to, const char *from, size_t count, int middle) {
     size_t write_count, start_pos;
+    unsigned long left;
 
     if (count == 0)
         return 0;
 
     write_count = count > COPY_BUF_SIZE ? COPY_BUF_SIZE : count;
     start_pos = middle ? (count - write_count) / 2 : 0;
-    if (copy_from_user(to, from + start_pos, write_count))
+
+    /* handlers run with preemption disabled, kretprobe return handlers as
+     * well, so a page that isn't resident gives no sample instead of a sleep */
+    pagefault_disable();
+    left = copy_from_user(to, from + start_pos, write_count);
+    pagefault_enable();
+    if (left)
         return 0;
 
     return (int)write_count;
 }
 EXPORT_SYMBOL(copy_start_middle);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+// same as 'copy_start_middle' but for any kind of iov_iter, 'from' isn't advanced
+int copy_start_middle_iter(char *to, struct iov_iter *from, size_t count, int middle) {
+    struct iov_iter iter = *from;
+    size_t write_count, start_pos, copied;
+
+    if (count == 0)
+        return 0;
+
+    write_count = count > COPY_BUF_SIZE ? COPY_BUF_SIZE : count;
+    start_pos = middle ? (count - write_count) / 2 : 0;
+    iov_iter_advance(&iter, start_pos);
+
+    /* handlers mustn't sleep, so a page that isn't resident gives a short sample */
+    pagefault_disable();
+    copied = copy_from_iter(to, write_count, &iter);
+    pagefault_enable();
+
+    return (int)copied;
+}
+EXPORT_SYMBOL(copy_start_middle_iter);
+#endif
+
 /* build entry with '\0's as separators */
 size_t entry_combiner(char *entry, const char **to_be_entry, size_t cnt) {
     size_t printed_len = 1;
@@ -190,3 +280,285 @@ void own_bdevname(struct block_device *bdev, char *buf) {
 		sprintf(buf, "/dev/%s%d", hd->disk_name, partno);
 }
 EXPORT_SYMBOL(own_bdevname);
+
+/* path dictionary: direct-mapped, so a collision simply evicts the older
+ * file and its path is sent again with its next event; slots are valid
+ * only in the current epoch, so the whole dictionary is dropped at once
+ * whenever a definition may have been lost on its way to the reader */
+struct path_dict_slot {
+    dev_t dev;
+    unsigned long ino;
+    u32 gen;
+    unsigned int epoch; /* 0 is never current */
+};
+
+static struct path_dict_slot path_dict_slots[PATH_DICT_SIZE];
+static DEFINE_SPINLOCK(path_dict_lock);
+static atomic_t path_dict_epoch = ATOMIC_INIT(1);
+
+static inline struct path_dict_slot *path_dict_slot(struct inode *inode) {
+    return &path_dict_slots[hash_long(inode->i_ino ^ inode->i_sb->s_dev, ilog2(PATH_DICT_SIZE))];
+}
+
+static inline int path_dict_match(struct path_dict_slot *slot, struct inode *inode) {
+    return slot->epoch == (unsigned int)atomic_read(&path_dict_epoch) && slot->ino == inode->i_ino &&
+           slot->dev == inode->i_sb->s_dev && slot->gen == inode->i_generation;
+}
+
+/* lockless, so it may be called with the ring buffer lock held */
+void path_dict_clear(void) {
+    if (!atomic_inc_return(&path_dict_epoch))
+        atomic_inc(&path_dict_epoch);
+}
+EXPORT_SYMBOL(path_dict_clear);
+
+/* returns 1 if the file wasn't known and its path must be sent */
+int path_dict_insert(struct inode *inode) {
+    struct path_dict_slot *slot = path_dict_slot(inode);
+    int ret = 0;
+
+    spin_lock(&path_dict_lock);
+    if (!path_dict_match(slot, inode)) {
+        slot->dev = inode->i_sb->s_dev;
+        slot->ino = inode->i_ino;
+        slot->gen = inode->i_generation;
+        slot->epoch = (unsigned int)atomic_read(&path_dict_epoch);
+        ret = 1;
+    }
+    spin_unlock(&path_dict_lock);
+
+    return ret;
+}
+EXPORT_SYMBOL(path_dict_insert);
+
+void path_dict_forget(struct inode *inode) {
+    struct path_dict_slot *slot = path_dict_slot(inode);
+
+    spin_lock(&path_dict_lock);
+    if (path_dict_match(slot, inode))
+        slot->epoch = 0;
+    spin_unlock(&path_dict_lock);
+}
+EXPORT_SYMBOL(path_dict_forget);
+
+void file_key_init(struct file_key *key, struct inode *inode) {
+    key->dev = inode->i_sb->s_dev;
+    key->ino = inode->i_ino;
+    key->gen = inode->i_generation;
+}
+EXPORT_SYMBOL(file_key_init);
+
+/* "@major:minor:ino:generation", major and minor are the same as in stat(1) */
+int file_key_id(struct file_key *key, char *buf) {
+    return sprintf(buf, "@%u:%u:%lu:%u", MAJOR(key->dev), MINOR(key->dev), key->ino, key->gen);
+}
+EXPORT_SYMBOL(file_key_id);
+
+int file_id(struct inode *inode, char *buf) {
+    struct file_key key;
+
+    file_key_init(&key, inode);
+    return file_key_id(&key, buf);
+}
+EXPORT_SYMBOL(file_id);
+
+/* cgroup v2 id of current task, 0 if it can't be resolved on this kernel */
+u64 current_cgroup_id(void) {
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    u64 id;
+
+    rcu_read_lock();
+    id = cgroup_id(task_dfl_cgroup(current));
+    rcu_read_unlock();
+    return id;
+#else
+    return 0;
+#endif
+}
+EXPORT_SYMBOL(current_cgroup_id);
+
+/* returns 1 if events of current task must be dropped */
+int cgroup_filtered(void) {
+    int i, allow_cnt = cgroup_allow_cnt, deny_cnt = cgroup_deny_cnt;
+    u64 id;
+
+    if (!allow_cnt && !deny_cnt)
+        return 0;
+
+    id = current_cgroup_id();
+    for (i = 0; i < deny_cnt; i++)
+        if (cgroup_deny[i] == id)
+            return 1;
+    if (!allow_cnt)
+        return 0;
+    for (i = 0; i < allow_cnt; i++)
+        if (cgroup_allow[i] == id)
+            return 0;
+    return 1;
+}
+EXPORT_SYMBOL(cgroup_filtered);
+
+/* comm is set by the task itself (prctl(PR_SET_NAME)), so anything
+ * non-printable is replaced to keep it from breaking records apart */
+void current_comm(char *buf) {
+    int i;
+
+    memcpy(buf, current->comm, TASK_COMM_LEN);
+    buf[TASK_COMM_LEN - 1] = '\0';
+    for (i = 0; buf[i]; i++) {
+        if ((unsigned char)buf[i] < 0x20 || (unsigned char)buf[i] >= 0x7f)
+            buf[i] = '?';
+    }
+}
+EXPORT_SYMBOL(current_comm);
+
+/* add an optional field to entry; handlers run with preemption disabled,
+ * so the allocation mustn't sleep and the field is skipped if it fails */
+size_t append_field(char **to_be_entry, size_t cnt, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    to_be_entry[cnt] = kvasprintf(GFP_ATOMIC, fmt, args);
+    va_end(args);
+
+    return to_be_entry[cnt] ? cnt + 1 : cnt;
+}
+EXPORT_SYMBOL(append_field);
+
+/* add 'tgid=', 'pid=', 'comm=' and 'cgid=' fields of current task to entry */
+size_t append_attribution(char **to_be_entry, size_t cnt) {
+    char comm[TASK_COMM_LEN];
+
+    current_comm(comm);
+
+    cnt = append_field(to_be_entry, cnt, "tgid=%d", task_tgid_nr(current));
+    cnt = append_field(to_be_entry, cnt, "pid=%d", task_pid_nr(current));
+    cnt = append_field(to_be_entry, cnt, "comm=%s", comm);
+    return append_field(to_be_entry, cnt, "cgid=%llu", (unsigned long long)current_cgroup_id());
+}
+EXPORT_SYMBOL(append_attribution);
+
+/* probe cost: time spent in handlers themselves, per CPU to stay cheap */
+bool probe_cost = 0;
+module_param(probe_cost, bool, 0644);
+MODULE_PARM_DESC(probe_cost, "Measure time spent in write handlers, shown in /proc/" LATENCY_PROC_NAME);
+
+struct probe_cost_cnt {
+    u64 hits, ns;
+};
+
+static DEFINE_PER_CPU(struct probe_cost_cnt[COST_PROBES], probe_costs);
+
+static const char *probe_cost_names[COST_PROBES] = {
+    [COST_VFS_WRITE] = "vfs_write",
+    [COST_WRITE_ITER] = "generic_write_checks",
+};
+
+void probe_cost_record(int probe, u64 start) {
+    if (!probe_cost || !start)
+        return;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 33)
+    /* no 'this_cpu' operations before 2.6.33-rc1, handlers run with preemption disabled */
+    per_cpu(probe_costs, smp_processor_id())[probe].hits++;
+    per_cpu(probe_costs, smp_processor_id())[probe].ns += ktime_get_ns() - start;
+#else
+    this_cpu_inc(probe_costs[probe].hits);
+    this_cpu_add(probe_costs[probe].ns, ktime_get_ns() - start);
+#endif
+}
+EXPORT_SYMBOL(probe_cost_record);
+
+static void probe_cost_show(struct seq_file *m) {
+    u64 hits, ns;
+    int i, cpu;
+
+    seq_printf(m, "\n%-20s %14s %14s %10s\n", "probe", "hits", "total_ns", "avg_ns");
+    for (i = 0; i < COST_PROBES; i++) {
+        hits = ns = 0;
+        for_each_possible_cpu(cpu) {
+            hits += per_cpu(probe_costs, cpu)[i].hits;
+            ns += per_cpu(probe_costs, cpu)[i].ns;
+        }
+        if (hits)
+            seq_printf(m, "%-20s %14llu %14llu %10llu\n", probe_cost_names[i], hits, ns, div64_u64(ns, hits));
+    }
+}
+
+/* latency histograms, one per filesystem type, filled by return probes */
+struct latency_hist {
+    struct file_system_type *fs;
+    char name[LAT_FS_NAME_LEN];
+    atomic_long_t buckets[LAT_OPS][LAT_BUCKETS];
+};
+
+static struct latency_hist latency_hists[LAT_FS_MAX];
+static int latency_hists_cnt = 0;
+static DEFINE_SPINLOCK(latency_lock);
+
+static const char *latency_op_names[LAT_OPS] = {
+    [LAT_WRITE] = "vfs_write",
+    [LAT_UNLINK] = "vfs_unlink",
+};
+
+static struct latency_hist *latency_hist_get(struct file_system_type *fs) {
+    struct latency_hist *hist = NULL;
+    int i, cnt = latency_hists_cnt;
+
+    smp_rmb();
+    for (i = 0; i < cnt; i++)
+        if (latency_hists[i].fs == fs)
+            return &latency_hists[i];
+
+    /* new filesystem type, entries are never removed */
+    spin_lock(&latency_lock);
+    for (i = 0; i < latency_hists_cnt; i++)
+        if (latency_hists[i].fs == fs)
+            hist = &latency_hists[i];
+    if (!hist && latency_hists_cnt < LAT_FS_MAX) {
+        hist = &latency_hists[latency_hists_cnt];
+        hist->fs = fs;
+        snprintf(hist->name, LAT_FS_NAME_LEN, "%s", fs->name);
+        smp_wmb();
+        latency_hists_cnt++;
+    }
+    spin_unlock(&latency_lock);
+
+    return hist;
+}
+
+void latency_record(struct file_system_type *fs, int op, s64 ns) {
+    struct latency_hist *hist = latency_hist_get(fs);
+    int bucket = ns > 0 ? fls64(ns) : 0;
+
+    if (!hist)
+        return;
+    if (bucket >= LAT_BUCKETS)
+        bucket = LAT_BUCKETS - 1;
+    atomic_long_inc(&hist->buckets[op][bucket]);
+}
+EXPORT_SYMBOL(latency_record);
+
+/* bucket N counts calls which took [2^(N-1), 2^N) ns */
+int latency_show(struct seq_file *m, void *v) {
+    int i, op, b, cnt = latency_hists_cnt;
+    unsigned long count;
+
+    smp_rmb();
+    seq_printf(m, "%-16s %-10s %14s %14s %s\n", "fs", "op", "from_ns", "to_ns", "count");
+    for (i = 0; i < cnt; i++) {
+        for (op = 0; op < LAT_OPS; op++) {
+            for (b = 0; b < LAT_BUCKETS; b++) {
+                count = atomic_long_read(&latency_hists[i].buckets[op][b]);
+                if (!count)
+                    continue;
+                seq_printf(m, "%-16s %-10s %14llu %14llu %lu\n", latency_hists[i].name,
+                           latency_op_names[op], b ? 1ULL << (b - 1) : 0ULL, 1ULL << b, count);
+            }
+        }
+    }
+
+    if (probe_cost)
+        probe_cost_show(m);
+    return 0;
+}
+EXPORT_SYMBOL(latency_show);
@@ -0,0 +1,313 @@
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include "header.h"
+
+/* heavy hitters: per-CPU count-min sketches of written bytes and operations
+ * plus a min-heap of the heaviest candidates, for files and for writers
+ * (thread groups); CPUs are merged on read of /proc/fs_monitor_top, all
+ * counters restart every 'topk_window' seconds
+ */
+bool topk = 0;
+module_param(topk, bool, 0444);
+MODULE_PARM_DESC(topk, "Track the most written files and writers in /proc/" TOPK_PROC_NAME);
+
+static uint topk_window = 60;
+module_param(topk_window, uint, 0644);
+MODULE_PARM_DESC(topk_window, "Length of the top-K window in seconds");
+
+struct topk_cand {
+    u64 key;
+    u64 bytes, ops;
+    char label[TOPK_LABEL_LEN];
+};
+
+struct topk_space {
+    u64 bytes[TOPK_DEPTH][TOPK_WIDTH];
+    u64 ops[TOPK_DEPTH][TOPK_WIDTH];
+    struct topk_cand heap[TOPK_CAND]; /* min-heap by bytes */
+    int ncand;
+};
+
+struct topk_cpu {
+    spinlock_t lock; /* taken by other CPUs only on read */
+    u64 window;
+    struct topk_space space[TOPK_SPACES];
+};
+
+static struct topk_cpu **topk_cpus = NULL;
+
+static const char *topk_space_names[TOPK_SPACES] = {
+    [TOPK_FILES] = "files",
+    [TOPK_WRITERS] = "writers",
+};
+
+/* window length doesn't fit in u32, so divisions by it take div64_u64 */
+static inline u64 topk_window_ns(void) {
+    return (u64)max(topk_window, 1U) * NSEC_PER_SEC;
+}
+
+static inline u64 topk_current_window(void) {
+    return div64_u64(ktime_get_ns(), topk_window_ns());
+}
+
+static inline size_t cms_index(u64 key, int row) {
+    return hash_64(key + (u64)(row + 1) * 0x9e3779b97f4a7c15ULL, ilog2(TOPK_WIDTH));
+}
+
+/* add to the sketch and return the new estimate */
+static u64 cms_add(u64 sketch[TOPK_DEPTH][TOPK_WIDTH], u64 key, u64 value) {
+    u64 est = U64_MAX;
+    int row;
+
+    for (row = 0; row < TOPK_DEPTH; row++) {
+        u64 *c = &sketch[row][cms_index(key, row)];
+        *c += value;
+        est = min(est, *c);
+    }
+    return est;
+}
+
+static u64 cms_query(u64 sketch[TOPK_DEPTH][TOPK_WIDTH], u64 key) {
+    u64 est = U64_MAX;
+    int row;
+
+    for (row = 0; row < TOPK_DEPTH; row++)
+        est = min(est, sketch[row][cms_index(key, row)]);
+    return est;
+}
+
+static void heap_swap(struct topk_cand *heap, int a, int b) {
+    struct topk_cand tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+}
+
+static void heap_down(struct topk_space *sp, int i) {
+    int child;
+
+    while ((child = 2 * i + 1) < sp->ncand) {
+        if (child + 1 < sp->ncand && sp->heap[child + 1].bytes < sp->heap[child].bytes)
+            child++;
+        if (sp->heap[i].bytes <= sp->heap[child].bytes)
+            break;
+        heap_swap(sp->heap, i, child);
+        i = child;
+    }
+}
+
+static void heap_up(struct topk_space *sp, int i) {
+    while (i > 0 && sp->heap[(i - 1) / 2].bytes > sp->heap[i].bytes) {
+        heap_swap(sp->heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* label is resolved only when the key gets into the heap */
+static void topk_update(int space, u64 key, u64 bytes, topk_label_fn label, void *arg) {
+    struct topk_cpu *cpu;
+    struct topk_space *sp;
+    u64 window = topk_current_window(), est_bytes, est_ops;
+    int i;
+
+    if (!topk_cpus)
+        return;
+    cpu = topk_cpus[smp_processor_id()];
+
+    spin_lock(&cpu->lock);
+    if (cpu->window != window) {
+        memset(cpu->space, 0, sizeof(cpu->space));
+        cpu->window = window;
+    }
+    sp = &cpu->space[space];
+
+    est_bytes = cms_add(sp->bytes, key, bytes);
+    est_ops = cms_add(sp->ops, key, 1);
+
+    for (i = 0; i < sp->ncand; i++) {
+        if (sp->heap[i].key == key) {
+            sp->heap[i].bytes = est_bytes;
+            sp->heap[i].ops = est_ops;
+            heap_down(sp, i);
+            goto unlock;
+        }
+    }
+
+    if (sp->ncand < TOPK_CAND) {
+        i = sp->ncand++;
+    } else if (est_bytes > sp->heap[0].bytes) {
+        i = 0;
+    } else
+        goto unlock;
+
+    sp->heap[i].key = key;
+    sp->heap[i].bytes = est_bytes;
+    sp->heap[i].ops = est_ops;
+    label(arg, sp->heap[i].label, TOPK_LABEL_LEN);
+    if (i == 0)
+        heap_down(sp, 0);
+    else
+        heap_up(sp, i);
+
+unlock:
+    spin_unlock(&cpu->lock);
+}
+
+static inline u64 file_key_hash(struct file_key *key) {
+    return hash_64(key->ino, 64) ^ ((u64)key->dev << 32) ^ key->gen;
+}
+
+void topk_account_file(struct file_key *key, u64 bytes, topk_label_fn label, void *arg) {
+    topk_update(TOPK_FILES, file_key_hash(key), bytes, label, arg);
+}
+EXPORT_SYMBOL(topk_account_file);
+
+static void writer_label(void *arg, char *buf, size_t len) {
+    char comm[TASK_COMM_LEN];
+
+    current_comm(comm);
+    snprintf(buf, len, "%s[%d]", comm, task_tgid_nr(current));
+}
+
+void topk_account_writer(u64 bytes) {
+    topk_update(TOPK_WRITERS, (u64)task_tgid_nr(current), bytes, writer_label, NULL);
+}
+EXPORT_SYMBOL(topk_account_writer);
+
+/* keep the end of long paths, it's the informative part */
+void topk_label_string(void *arg, char *buf, size_t len) {
+    const char *str = IS_ERR_OR_NULL(arg) ? "?" : (const char *)arg;
+    size_t slen = strlen(str);
+
+    if (slen >= len)
+        str += slen - (len - 1);
+    snprintf(buf, len, "%s", str);
+}
+EXPORT_SYMBOL(topk_label_string);
+
+void topk_label_file(void *arg, char *buf, size_t len) {
+    char path_buf[MAX_PATH_LEN];
+    topk_label_string(d_path(&((struct file *)arg)->f_path, path_buf, MAX_PATH_LEN), buf, len);
+}
+EXPORT_SYMBOL(topk_label_file);
+
+void topk_label_dentry(void *arg, char *buf, size_t len) {
+    char path_buf[MAX_PATH_LEN];
+    topk_label_string(own_dentry_path((struct dentry *)arg, path_buf, MAX_PATH_LEN), buf, len);
+}
+EXPORT_SYMBOL(topk_label_dentry);
+
+int topk_init(void) {
+    int cpu;
+
+    if (!topk)
+        return 0;
+
+    topk_cpus = kcalloc(nr_cpu_ids, sizeof(struct topk_cpu *), GFP_KERNEL);
+    if (!topk_cpus)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        topk_cpus[cpu] = vzalloc(sizeof(struct topk_cpu));
+        if (!topk_cpus[cpu]) {
+            topk_destroy();
+            return -ENOMEM;
+        }
+        spin_lock_init(&topk_cpus[cpu]->lock);
+    }
+    return 0;
+}
+EXPORT_SYMBOL(topk_init);
+
+void topk_destroy(void) {
+    int cpu;
+
+    if (!topk_cpus)
+        return;
+    for_each_possible_cpu(cpu)
+        vfree(topk_cpus[cpu]);
+    kfree(topk_cpus);
+    topk_cpus = NULL;
+}
+EXPORT_SYMBOL(topk_destroy);
+
+static int cmp_cand_key(const void *a, const void *b) {
+    const struct topk_cand *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int cmp_cand_bytes(const void *a, const void *b) {
+    const struct topk_cand *x = a, *y = b;
+    if (x->bytes != y->bytes)
+        return x->bytes > y->bytes ? -1 : 1;
+    return x->ops > y->ops ? -1 : x->ops < y->ops;
+}
+
+/* candidates of every CPU are deduplicated and estimated on the sum of all sketches */
+static void topk_show_space(struct seq_file *m, int space, u64 window) {
+    struct topk_cand *all;
+    struct topk_space *sp;
+    size_t n = 0, uniq = 0, i;
+    int cpu;
+
+    all = vmalloc(sizeof(struct topk_cand) * TOPK_CAND * num_possible_cpus());
+    if (!all)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        spin_lock(&topk_cpus[cpu]->lock);
+        if (topk_cpus[cpu]->window == window) {
+            sp = &topk_cpus[cpu]->space[space];
+            memcpy(all + n, sp->heap, sizeof(struct topk_cand) * sp->ncand);
+            n += sp->ncand;
+        }
+        spin_unlock(&topk_cpus[cpu]->lock);
+    }
+
+    sort(all, n, sizeof(struct topk_cand), cmp_cand_key, NULL);
+    for (i = 0; i < n; i++)
+        if (!uniq || all[uniq - 1].key != all[i].key)
+            all[uniq++] = all[i];
+
+    for (i = 0; i < uniq; i++) {
+        all[i].bytes = all[i].ops = 0;
+        for_each_possible_cpu(cpu) {
+            spin_lock(&topk_cpus[cpu]->lock);
+            if (topk_cpus[cpu]->window == window) {
+                sp = &topk_cpus[cpu]->space[space];
+                all[i].bytes += cms_query(sp->bytes, all[i].key);
+                all[i].ops += cms_query(sp->ops, all[i].key);
+            }
+            spin_unlock(&topk_cpus[cpu]->lock);
+        }
+    }
+
+    sort(all, uniq, sizeof(struct topk_cand), cmp_cand_bytes, NULL);
+    for (i = 0; i < uniq && i < TOPK_SHOW; i++)
+        seq_printf(m, "%-8s %20llu %12llu %s\n", topk_space_names[space],
+                   all[i].bytes, all[i].ops, all[i].label);
+
+    vfree(all);
+}
+
+int topk_show(struct seq_file *m, void *v) {
+    u64 length = topk_window_ns(), now = ktime_get_ns();
+    u64 window = div64_u64(now, length);
+    int space;
+
+    if (!topk_cpus) {
+        seq_printf(m, "# disabled, load with topk=1\n");
+        return 0;
+    }
+
+    seq_printf(m, "# window %llus, %llu ms elapsed, estimates may be over\n",
+               div_u64(length, NSEC_PER_SEC), div_u64(now - window * length, NSEC_PER_MSEC));
+    seq_printf(m, "%-8s %20s %12s %s\n", "space", "bytes", "ops", "name");
+    for (space = 0; space < TOPK_SPACES; space++)
+        topk_show_space(m, space, window);
+    return 0;
+}
+EXPORT_SYMBOL(topk_show);
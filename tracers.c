@@ -1,6 +1,8 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/fs.h>
+#include <linux/kprobes.h>
+#include <linux/uio.h>
 #include "header.h"
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(6, 0, 0)
@@ -8,7 +10,33 @@
 #endif
 
 int data_available = 0;
-char monitor_entry[ENTRY_SIZE];
+char monitor_entry[MONITOR_ENTRY_SIZE];
+size_t monitor_entry_len = 0;
+int monitor_entry_def = 0;
+
+bool path_dict = 0;
+module_param(path_dict, bool, 0644);
+MODULE_PARM_DESC(path_dict, "Send '@major:minor:ino:gen' instead of the path, paths are sent in '<path_def>' records until a reader got them");
+
+bool attribution = 0;
+module_param(attribution, bool, 0644);
+MODULE_PARM_DESC(attribution, "Add 'tgid=', 'pid=', 'comm=' and 'cgid=' fields to events");
+
+bool stream = 1;
+module_param(stream, bool, 0644);
+MODULE_PARM_DESC(stream, "Put events to /dev/" DEVNAME ", with topk=1 it may be turned off to keep statistics only");
+
+bool iter_hook = 0;
+module_param(iter_hook, bool, 0444);
+MODULE_PARM_DESC(iter_hook, "Trace writes at generic_write_checks instead of vfs_write: covers writev, pwritev, AIO and io_uring (4.1+)");
+
+bool ret_probes = 0;
+module_param(ret_probes, bool, 0444);
+MODULE_PARM_DESC(ret_probes, "Trace vfs_write and vfs_unlink at return: add 'ret=' and 'lat=' fields and latency histograms, can't be used with iter_hook");
+
+bool drop_failed = 0;
+module_param(drop_failed, bool, 0644);
+MODULE_PARM_DESC(drop_failed, "With ret_probes, don't report failed calls");
 
 static inline struct inode *get_file_inode(struct file *file) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 9, 0)
@@ -18,137 +46,295 @@ static inline struct inode *get_file_inode(struct file *file) {
 #endif
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
-#include <linux/hrtimer.h>
-#include <linux/ktime.h>
-static inline s64 ktime_get_ns(void) {
-    return ktime_to_ns(ktime_get()); /* 'ktime_get_ns' was added with 'linux/timekeeping.h' header in 3.17-rc1 */
+/* result of a call paired by kretprobe, appended as 'ret=' and 'lat=' fields */
+static size_t append_result(char **to_be_entry, size_t cnt, struct op_result *res) {
+    cnt = append_field(to_be_entry, cnt, "ret=%lld", (long long)res->ret);
+    return append_field(to_be_entry, cnt, "lat=%lld", res->latency);
 }
-#endif
 
-/* in x86_64 registers is used for arguments passing: rdi, rsi, rdx, rcx, r8, r9
- * but in 'struct pt_regs' we sometimes actually have r10, r9, r8, ... (???)
- */
-int vfs_write_trace(struct kprobe *p, struct pt_regs *regs) {
-    /* taken from declaration of 'vfs_write' function
-     * ssize_t vfs_write(struct file *file, const char __user *buf, size_t count, loff_t *pos)
-     */
-    struct file *file = (struct file *)regs->di;
-    const char *buf = (const char *)regs->si;
-    size_t count = (size_t)regs->dx;
-    loff_t *ppos = (loff_t *)regs->cx;
+/* polling readers get only the last entry, so a path definition that is
+ * overwritten before it was read is lost and every path must be sent again */
+static inline void monitor_entry_reset(void) {
+    if (monitor_entry_def && !overload)
+        path_dict_clear();
+    monitor_entry_def = 0;
+    memset(monitor_entry, 0, MONITOR_ENTRY_SIZE);
+}
 
+static inline void wake_up_readers(void) {
+    if (!data_available) {
+        data_available = 1;
+        wake_up_interruptible(&wait_queue);
+    }
+}
+
+/* build write entry and put it to ring buffer, data is sampled from 'iter'
+ * if it's set or from 'buf' otherwise, 'res' is NULL if the call isn't paired */
+static int write_entry(struct file *file, const char *buf, struct iov_iter *iter, size_t count,
+                       loff_t pos, loff_t size, s64 ts, struct op_result *res) {
     /* some buffers */
     char kbuf[COPY_BUF_SIZE],
          filename[MAX_PATH_LEN],
-         *path;
+         id[FILE_ID_SIZE],
+         *path = NULL;
 
-    int write_count;
-    size_t r, entry_current_size = 0;
-    loff_t pos = ppos ? *ppos : 0;
+    int write_count, dict = path_dict; /* the parameter may change meanwhile */
+    size_t r, def_size = 0, entry_current_size = 0;
 
     char **to_be_entry;
+    const char *path_def[4];
 
-    /* we want work only with writes on real files on real FS */
-    if (!file || !is_regular(file->f_path.dentry))
-        return 0;
+    /* a path that can't be resolved (-ENAMETOOLONG) drops the event before anything is built */
+    if (!dict) {
+        path = d_path(&file->f_path, filename, MAX_PATH_LEN);
+        if (IS_ERR(path))
+            return 0;
+    }
 
     to_be_entry = kmalloc(ENTRY_MAX_CNT_SIZE * sizeof(char *), GFP_KERNEL);
     memset(to_be_entry, 0, ENTRY_MAX_CNT_SIZE * sizeof(char *));
 
-    /* clean up global entry by memset */
-    memset(monitor_entry, 0, ENTRY_SIZE);
+    /* clean up global entry */
+    monitor_entry_reset();
 
     /* timestamp */
     to_be_entry[entry_current_size] = kmalloc(SPEC_STRINGS_SIZE, GFP_KERNEL);
-    sprintf(to_be_entry[entry_current_size++], "%lld", ktime_get_ns());
-
-    /* file path */
-    path = d_path(&file->f_path, filename, MAX_PATH_LEN);
-    /* WARNING: path is actually filename + some_offset, so
-     * it can't be managed or kfreed, so we need to kmalloc it
-     */
-    to_be_entry[entry_current_size] = kmalloc(strlen(path) + 1, GFP_KERNEL);
-    sprintf(to_be_entry[entry_current_size++], "%s", path);
+    sprintf(to_be_entry[entry_current_size++], "%lld", ts);
+
+    if (dict) {
+        /* file identifier, path is resolved only for files not sent yet */
+        file_id(get_file_inode(file), id);
+        if (path_dict_insert(get_file_inode(file))) {
+            path_def[0] = to_be_entry[0];
+            path_def[1] = "<path_def>";
+            path_def[2] = id;
+            path_def[3] = d_path(&file->f_path, filename, MAX_PATH_LEN);
+            if (!IS_ERR(path_def[3]))
+                def_size = entry_combiner(monitor_entry, path_def, 4);
+            else
+                path_dict_forget(get_file_inode(file));
+        }
+        to_be_entry[entry_current_size] = kmalloc(FILE_ID_SIZE, GFP_KERNEL);
+        sprintf(to_be_entry[entry_current_size++], "%s", id);
+    } else {
+        /* file path, resolved above
+         * WARNING: path is actually filename + some_offset, so
+         * it can't be managed or kfreed, so we need to kmalloc it
+         */
+        to_be_entry[entry_current_size] = kmalloc(strlen(path) + 1, GFP_KERNEL);
+        sprintf(to_be_entry[entry_current_size++], "%s", path);
+    }
 
     /* middle data */
-    write_count = copy_start_middle(kbuf, buf, count, 1);
+    write_count = iter ? copy_start_middle_iter(kbuf, iter, count, 1) : copy_start_middle(kbuf, buf, count, 1);
     to_be_entry[entry_current_size] = kmalloc(BASE64_ENCODED_MAX, GFP_KERNEL);
     r = base64_encode((const u8 *)kbuf, write_count, to_be_entry[entry_current_size]);
     to_be_entry[entry_current_size++][r] = '\0';
 
     /* file size */
     to_be_entry[entry_current_size] = kmalloc(SPEC_STRINGS_SIZE, GFP_KERNEL);
-    sprintf(to_be_entry[entry_current_size++], "%lld",
-            max(pos + (loff_t)count, get_file_inode(file)->i_size));
+    sprintf(to_be_entry[entry_current_size++], "%lld", size);
 
     /* beginning data */
     to_be_entry[entry_current_size] = kmalloc(BASE64_ENCODED_MAX, GFP_KERNEL);
     if (pos == 0) {
-        write_count = copy_start_middle(kbuf, buf, count, 0);
+        write_count = iter ? copy_start_middle_iter(kbuf, iter, count, 0) : copy_start_middle(kbuf, buf, count, 0);
         r = base64_encode((const u8 *) kbuf, write_count, to_be_entry[entry_current_size]);
         to_be_entry[entry_current_size++][r] = '\0';
     } else
         sprintf(to_be_entry[entry_current_size++], "<not_a_beginning>");
 
-    /* write entry to ring buffer */
-    r = entry_combiner(monitor_entry, (const char **)to_be_entry, entry_current_size);
-    ring_buffer_append(rbuf, monitor_entry, r);
+    /* real result and latency */
+    if (res)
+        entry_current_size = append_result(to_be_entry, entry_current_size, res);
+
+    /* process attribution */
+    if (attribution)
+        entry_current_size = append_attribution(to_be_entry, entry_current_size);
+
+    /* write entry to ring buffer, path definition goes right before it */
+    r = entry_combiner(monitor_entry + def_size, (const char **)to_be_entry, entry_current_size);
+    monitor_entry_len = def_size + r;
+    monitor_entry_def = def_size > 0;
+    ring_buffer_append(rbuf, monitor_entry, monitor_entry_len);
 
     /* cleanup and wake up poll */
     free_ptr_array((void **)to_be_entry, entry_current_size);
-    if (!data_available) {
-        data_available = 1;
-        wake_up_interruptible(&wait_queue);
+    wake_up_readers();
+
+    return 0;
+}
+
+/* filters and accounting shared by write probes, then the entry itself */
+static int write_event(struct file *file, const char *buf, struct iov_iter *iter, size_t count, loff_t pos) {
+    struct file_key key;
+    s64 ts;
+
+    /* noisy cgroups are dropped before anything else */
+    if (cgroup_filtered())
+        return 0;
+
+    /* we want work only with writes on real files on real FS */
+    if (!file || !is_regular(file->f_path.dentry))
+        return 0;
+
+    ts = ktime_get_ns();
+    file_key_init(&key, get_file_inode(file));
+    if (topk) {
+        topk_account_file(&key, count, topk_label_file, file);
+        topk_account_writer(count);
     }
+    if (!stream)
+        return 0;
+
+    /* under overload only per-inode counters are updated */
+    if (overload_write(&key, count, ts, topk_label_file, file))
+        return 0;
+
+    /* the write didn't happen yet, so the size is a guess */
+    return write_entry(file, buf, iter, count, pos,
+                       max(pos + (loff_t)count, get_file_inode(file)->i_size),
+                       ts, NULL);
+}
+
+/* in x86_64 registers is used for arguments passing: rdi, rsi, rdx, rcx, r8, r9
+ * but in 'struct pt_regs' we sometimes actually have r10, r9, r8, ... (???)
+ */
+int vfs_write_trace(struct kprobe *p, struct pt_regs *regs) {
+    /* taken from declaration of 'vfs_write' function
+     * ssize_t vfs_write(struct file *file, const char __user *buf, size_t count, loff_t *pos)
+     */
+    struct file *file = (struct file *)regs->di;
+    const char *buf = (const char *)regs->si;
+    size_t count = (size_t)regs->dx;
+    loff_t *ppos = (loff_t *)regs->cx;
+    u64 start = probe_cost ? ktime_get_ns() : 0;
 
+    write_event(file, buf, NULL, count, ppos ? *ppos : 0);
+    probe_cost_record(COST_VFS_WRITE, start);
     return 0;
 }
 EXPORT_SYMBOL(vfs_write_trace);
 
-int vfs_unlink_trace(struct kprobe *p, struct pt_regs *regs) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+/* every data-modifying path of most filesystems goes through 'generic_write_checks':
+ * write, writev, pwritev, AIO and io_uring, buffered and direct; the file and
+ * position come from kiocb and data is sampled from iov_iter, whatever its type
+ *
+ * a write that is restarted runs the checks again and is reported again:
+ * xfs extending writes, ext4 direct writes retried or falling back to buffered
+ * ones and IOCB_NOWAIT attempts of AIO and io_uring that got -EAGAIN; events
+ * don't say which attempt succeeded, ret_probes=1 without iter_hook does */
+int write_iter_trace(struct kprobe *p, struct pt_regs *regs) {
+    /* taken from declaration of 'generic_write_checks' function
+     * ssize_t generic_write_checks(struct kiocb *iocb, struct iov_iter *from)
+     */
+    struct kiocb *iocb = (struct kiocb *)regs->di;
+    struct iov_iter *from = (struct iov_iter *)regs->si;
+    u64 start = probe_cost ? ktime_get_ns() : 0;
+    loff_t pos;
+
+    if (iocb && from) {
+        /* appending writes are moved to the end by the checks themselves */
+        pos = iocb->ki_flags & IOCB_APPEND ? i_size_read(get_file_inode(iocb->ki_filp)) : iocb->ki_pos;
+        write_event(iocb->ki_filp, NULL, from, iov_iter_count(from), pos);
+    }
+    probe_cost_record(COST_WRITE_ITER, start);
+    return 0;
+}
+EXPORT_SYMBOL(write_iter_trace);
+#endif
+
+int vfs_write_entry(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct write_call *call = (struct write_call *)ri->data;
+    struct file *file = (struct file *)regs->di;
+    loff_t *ppos = (loff_t *)regs->cx;
+
+    /* non-zero return skips the return handler */
+    if (cgroup_filtered())
+        return 1;
+    if (!file || !is_regular(file->f_path.dentry))
+        return 1;
+
+    call->file = file;
+    call->buf = (const char *)regs->si;
+    call->pos = ppos ? *ppos : 0;
+    call->ts = ktime_get_ns();
+    return 0;
+}
+EXPORT_SYMBOL(vfs_write_entry);
+
+int vfs_write_ret(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct write_call *call = (struct write_call *)ri->data;
+    struct op_result res;
+    struct file_key key;
+
+    res.ret = (ssize_t)regs_return_value(regs);
+    res.latency = ktime_get_ns() - call->ts;
+    latency_record(call->file->f_path.dentry->d_sb->s_type, LAT_WRITE, res.latency);
+
+    if (drop_failed && res.ret < 0)
+        return 0;
+
+    file_key_init(&key, get_file_inode(call->file));
+    if (topk && res.ret >= 0) {
+        topk_account_file(&key, res.ret, topk_label_file, call->file);
+        topk_account_writer(res.ret);
+    }
+    if (!stream)
+        return 0;
+
+    if (overload_write(&key, res.ret > 0 ? (size_t)res.ret : 0, call->ts, topk_label_file, call->file))
+        return 0;
+
+    /* only written bytes are sampled, size is already updated by the write */
+    return write_entry(call->file, call->buf, NULL, res.ret > 0 ? (size_t)res.ret : 0, call->pos,
+                       get_file_inode(call->file)->i_size, call->ts, &res);
+}
+EXPORT_SYMBOL(vfs_write_ret);
+
+static struct dentry *unlink_dentry(struct pt_regs *regs) {
 #if LINUX_VERSION_CODE > KERNEL_VERSION(5, 11, 0)
     /* taken from declaration of 'do_unlinkat' function
      * int vfs_unlink(struct user_namespace *mnt_userns, struct inode *dir,
            struct dentry *dentry, struct inode **delegated_inode)
      * first argument is varied on versions 5.12-6.12, but we don't
-     * need it at all, so it will be 'void *dummy' */
-    void *dummy = (void *)regs->di;
-    struct inode *dir = (struct inode *)regs->si;
-    struct dentry *dentry = (struct dentry *)regs->dx;
-    struct inode **delegated_inode = (struct inode **)regs->r10;
+     * need it at all */
+    return (struct dentry *)regs->dx;
 #else
     /* taken from declaration of 'do_unlinkat' function
      * int vfs_unlink(struct inode *dir, struct dentry *dentry,
            struct inode **delegated_inode) */
-    struct inode *dir = (struct inode *)regs->di;
-    struct dentry *dentry = (struct dentry *)regs->si;
-    struct inode **delegated_inode = (struct inode **)regs->dx;
+    return (struct dentry *)regs->si;
 #endif
-    char *path, path_buf[MAX_PATH_LEN];
+}
+
+/* build unlink entry and put it to ring buffer, 'res' is NULL if the call isn't paired */
+static int unlink_entry(struct block_device *bdev, const char *path, const char *id,
+                        s64 ts, struct op_result *res) {
     size_t r, entry_current_size = 0;
 
     char **to_be_entry;
 
-    if (!dentry || !is_regular(dentry))
+    /* own_dentry_path() gives ERR_PTR(-ENAMETOOLONG) for too long paths */
+    if (IS_ERR_OR_NULL(path))
         return 0;
 
     to_be_entry = kmalloc(ENTRY_MAX_CNT_SIZE * sizeof(char *), GFP_KERNEL);
     memset(to_be_entry, 0, ENTRY_MAX_CNT_SIZE * sizeof(char *));
 
-    /* clean up global entry by memset */
-    memset(monitor_entry, 0, ENTRY_SIZE);
+    /* clean up global entry */
+    monitor_entry_reset();
 
     /* timestamp */
     to_be_entry[entry_current_size] = kmalloc(SPEC_STRINGS_SIZE, GFP_KERNEL);
-    sprintf(to_be_entry[entry_current_size++], "%lld", ktime_get_ns());
+    sprintf(to_be_entry[entry_current_size++], "%lld", ts);
 
     /* device name */
     to_be_entry[entry_current_size] = kmalloc(MAX_PATH_LEN, GFP_KERNEL);
-    own_bdevname(dentry->d_sb->s_bdev, to_be_entry[entry_current_size++]);
+    own_bdevname(bdev, to_be_entry[entry_current_size++]);
 
     /* file path */
-    path = own_dentry_path(dentry, path_buf, MAX_PATH_LEN);
     to_be_entry[entry_current_size] = kmalloc(strlen(path) + 1, GFP_KERNEL);
     sprintf(to_be_entry[entry_current_size++], "%s", path);
 
@@ -156,31 +342,147 @@ int vfs_unlink_trace(struct kprobe *p, struct pt_regs *regs) {
     to_be_entry[entry_current_size] = kmalloc(SPEC_STRINGS_SIZE, GFP_KERNEL);
     sprintf(to_be_entry[entry_current_size++], "<deleted>");
 
+    /* file identifier */
+    if (id)
+        entry_current_size = append_field(to_be_entry, entry_current_size, "%s", id);
+
+    /* real result and latency */
+    if (res)
+        entry_current_size = append_result(to_be_entry, entry_current_size, res);
+
+    /* process attribution */
+    if (attribution)
+        entry_current_size = append_attribution(to_be_entry, entry_current_size);
+
     /* write entry to ring buffer */
     r = entry_combiner(monitor_entry, (const char **)to_be_entry, entry_current_size);
+    monitor_entry_len = r;
     ring_buffer_append(rbuf, monitor_entry, r);
 
     /* cleanup and wake up poll */
     free_ptr_array((void **)to_be_entry, entry_current_size);
-    if (!data_available) {
-        data_available = 1;
-        wake_up_interruptible(&wait_queue);
-    }
+    wake_up_readers();
 
     return 0;
 }
+
+/* file identifier of the unlinked file, the inode number may be reused after unlink */
+static char *unlink_id(struct dentry *dentry, char *buf) {
+    if (!path_dict || !dentry->d_inode)
+        return NULL;
+    file_id(dentry->d_inode, buf);
+    path_dict_forget(dentry->d_inode);
+    return buf;
+}
+
+int vfs_unlink_trace(struct kprobe *p, struct pt_regs *regs) {
+    struct dentry *dentry = unlink_dentry(regs);
+    char *path, path_buf[MAX_PATH_LEN], id[FILE_ID_SIZE];
+    struct file_key key;
+    s64 ts;
+
+    /* noisy cgroups are dropped before anything else */
+    if (cgroup_filtered())
+        return 0;
+
+    if (!dentry || !is_regular(dentry))
+        return 0;
+
+    ts = ktime_get_ns();
+    if (topk && dentry->d_inode) {
+        file_key_init(&key, dentry->d_inode);
+        topk_account_file(&key, 0, topk_label_dentry, dentry);
+        topk_account_writer(0);
+    }
+    if (!stream) {
+        unlink_id(dentry, id);
+        return 0;
+    }
+
+    /* under overload only per-inode counters are updated */
+    if (dentry->d_inode) {
+        file_key_init(&key, dentry->d_inode);
+        if (overload_unlink(&key, ts, topk_label_dentry, dentry)) {
+            unlink_id(dentry, id);
+            return 0;
+        }
+    }
+
+    path = own_dentry_path(dentry, path_buf, MAX_PATH_LEN);
+    return unlink_entry(dentry->d_sb->s_bdev, path, unlink_id(dentry, id), ts, NULL);
+}
 EXPORT_SYMBOL(vfs_unlink_trace);
 
+int vfs_unlink_entry(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct unlink_call *call = (struct unlink_call *)ri->data;
+    struct dentry *dentry = unlink_dentry(regs);
+
+    /* non-zero return skips the return handler */
+    if (cgroup_filtered())
+        return 1;
+    if (!dentry || !is_regular(dentry))
+        return 1;
+
+    /* dentry may be already negative at return, so take everything now */
+    call->sb = dentry->d_sb;
+    if (dentry->d_inode)
+        file_key_init(&call->key, dentry->d_inode);
+    else
+        memset(&call->key, 0, sizeof(call->key));
+    call->path = own_dentry_path(dentry, call->path_buf, MAX_PATH_LEN);
+    call->id = unlink_id(dentry, call->id_buf);
+    call->ts = ktime_get_ns();
+    return 0;
+}
+EXPORT_SYMBOL(vfs_unlink_entry);
+
+int vfs_unlink_ret(struct kretprobe_instance *ri, struct pt_regs *regs) {
+    struct unlink_call *call = (struct unlink_call *)ri->data;
+    struct op_result res;
+
+    res.ret = (ssize_t)regs_return_value(regs);
+    res.latency = ktime_get_ns() - call->ts;
+    latency_record(call->sb->s_type, LAT_UNLINK, res.latency);
+
+    if (drop_failed && res.ret < 0)
+        return 0;
+
+    if (topk && call->key.ino && res.ret == 0) {
+        topk_account_file(&call->key, 0, topk_label_string, call->path);
+        topk_account_writer(0);
+    }
+    if (!stream)
+        return 0;
+
+    if (call->key.ino && overload_unlink(&call->key, call->ts, topk_label_string, (void *)call->path))
+        return 0;
+
+    return unlink_entry(call->sb->s_bdev, call->path, call->id, call->ts, &res);
+}
+EXPORT_SYMBOL(vfs_unlink_ret);
+
 int vfs_rename_trace(struct kprobe *p, struct pt_regs *regs) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
     /* int vfs_rename(struct inode *old_dir, struct dentry *old_dentry,
                       struct inode *new_dir, struct dentry *new_dentry,
                       ...) */
+    struct dentry *old_dentry = (struct dentry *)regs->si;
 #else
     /* int vfs_rename(struct renamedata *rd) */
+    struct renamedata *rd = (struct renamedata *)regs->di;
+    struct dentry *old_dentry = rd ? rd->old_dentry : NULL;
 #endif
     TODO();
 
+    /* renamed file must get its new path sent with the next event,
+     * a renamed directory changes paths of everything below it */
+    if (path_dict && old_dentry && old_dentry->d_inode) {
+        if (S_ISDIR(old_dentry->d_inode->i_mode))
+            path_dict_clear();
+        else
+            path_dict_forget(old_dentry->d_inode);
+    }
+
     return 0;
 }
 EXPORT_SYMBOL(vfs_rename_trace);